@@ -1,68 +1,141 @@
 // Mazu Editor: minimalist editor with syntax highlight, copy/paste, and search
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define CTRL_(k) ((k) & (0x1f))
 #define TAB_STOP 4
 
-typedef struct {
-    int idx;
+typedef struct editor_row {
     int size;
     int render_size;
+    /* The text of a row is kept in a gap buffer: chars[0, gap) and the last
+     * (size - gap) bytes of the capacity hold the line, with the hole left at
+     * the last edit point so that typing there does not move the tail.
+     * A capacity of 0 means chars still points into the file mapping.
+     */
+    int capacity;
+    int gap;
     char *chars;
     char *render;
     unsigned char *highlight;
-    int hl_open_comment;
+    unsigned hl_state; /* lexer state at the end of the line */
+    unsigned hl_start; /* the state it was lexed from */
+    unsigned char flags;
+    /* Rows live in an implicit treap ordered by line number: the index of a
+     * row is never stored, it is derived from the subtree counts.
+     */
+    struct editor_row *left, *right, *parent;
+    int count; /* rows in this subtree */
+    unsigned priority;
 } editor_row;
 
+/* render and highlight are built lazily, when a row is about to be shown */
+#define ROW_RENDER (1 << 0)
+#define ROW_HIGHLIGHT (1 << 1)
+#define ROW_SHARED (1 << 2) /* render aliases chars: the line has no tabs */
+#define ROW_PINNED (1 << 3) /* chars is part of the snapshot being saved */
+/* hl_state is the end state of the text as it is, when lexed from
+ * hl_start: a row needs lexing again only if either has changed
+ */
+#define ROW_LEXED (1 << 4)
+
+struct keyword_table;
+struct lexer;
+
 typedef struct {
     char *file_type;
     char **file_match;
     char **keywords;
-    char *sl_comment_start;                  /* single line */
-    char *ml_comment_start, *ml_comment_end; /* multiple lines */
     int flags;
+    struct lexer *lexer; /* comments, strings and whatever else spans text */
+    /* compiled when the syntax is loaded */
+    struct keyword_table *keyword_table;
+    unsigned char char_class[256]; /* CC_* bits of each byte */
+    bool simd_words; /* identifier bytes are all CC_WORD */
 } editor_syntax;
 
+/* How hard save_file() works to get a save onto stable storage */
+enum save_sync {
+    SYNC_NONE, /* leave writeback to the kernel */
+    SYNC_FILE, /* fsync the new contents before they replace the old ones */
+    SYNC_FULL, /* also fsync the directory, so the rename itself persists */
+};
+
 struct {
     int cursor_x, cursor_y, render_x;
     int row_offset, col_offset;
     int screen_rows, screen_cols;
     int num_rows;
-    editor_row *row;
+    editor_row *rows; /* root of the row treap */
     int modified;
     char *file_name;
     char status_msg[80];
-    time_t status_msg_time;
     char *copied_char_buffer;
     editor_syntax *syntax;
+    char *map; /* read-only mapping of the opened file */
+    size_t map_size;
+    bool map_lost; /* the file shrank under the mapping, see map_fault() */
+    int hl_frontier; /* rows before this one have an up to date lexer state */
+    int hl_dirty;    /* nothing changed at or past this row, see hl_frontier */
+    enum save_sync save_sync;
+    int signal_fd;     /* SIGWINCH, SIGCONT and SIGTERM */
+    int message_timer; /* expires the status message */
+    int wake_fd;       /* background threads post completions here */
+    int term; /* TERM_* capabilities, from probe_terminal() */
+    int esc_timeout;    /* ms to wait for the rest of an escape sequence */
+    int frame_rate;     /* most frames drawn in a second */
+    bool low_bandwidth; /* fewer frames, a smaller backlog and no clock */
     struct termios orig_termios;
 } ec = {
     /* editor config */
-    .cursor_x = 0,         .cursor_y = 0,        .render_x = 0,
-    .row_offset = 0,       .col_offset = 0,      .num_rows = 0,
-    .row = NULL,           .modified = 0,        .file_name = NULL,
-    .status_msg[0] = '\0', .status_msg_time = 0, .copied_char_buffer = NULL,
-    .syntax = NULL,
+    .cursor_x = 0,         .cursor_y = 0,          .render_x = 0,
+    .row_offset = 0,       .col_offset = 0,        .num_rows = 0,
+    .rows = NULL,          .modified = 0,          .file_name = NULL,
+    .status_msg[0] = '\0', .syntax = NULL,         .copied_char_buffer = NULL,
+    .map = NULL,           .map_size = 0,          .hl_frontier = 0,
+    .hl_dirty = 0,         .save_sync = SYNC_FULL, .esc_timeout = 50,
 };
 
+#define TERM_SYNC (1 << 0)      /* synchronized output, mode 2026 */
+#define TERM_TRUECOLOR (1 << 1) /* 24-bit colors */
+#define TERM_SCROLL (1 << 2)    /* answered DA1: scroll regions, insert line */
+
+/* The save in flight, if any; see save_file() */
+struct save_job *saving = NULL;
+
+/* Output is composed in a buffer that lives across frames and only grows */
 typedef struct {
     char *buf;
-    int len;
+    int len, capacity;
 } editor_buf;
 
 /* clang-format off */
@@ -71,41 +144,59 @@ enum editor_key {
     ARROW_LEFT = 0x3e8, ARROW_RIGHT, ARROW_UP, ARROW_DOWN,
     PAGE_UP, PAGE_DOWN,
     HOME_KEY, END_KEY, DEL_KEY,
+    PASTE_START, /* bracketed paste: the text follows up to CSI 201 ~ */
 };
 
+/* Modifiers of special keys, as or'ed into their editor_key */
+#define KEY_SHIFT (1 << 12)
+#define KEY_ALT (1 << 13)
+#define KEY_CTRL (1 << 14)
+#define KEY_MODS (KEY_SHIFT | KEY_ALT | KEY_CTRL)
+
 enum editor_highlight {
     NORMAL,     MATCH,
     SL_COMMENT, ML_COMMENT,
     KEYWORD_1,  KEYWORD_2,  KEYWORD_3,
     STRING,     NUMBER,
 };
-/* clang-format on */
-
-#define HIGHLIGHT_NUMBERS (1 << 0)
-#define HIGHLIGHT_STRINGS (1 << 1)
-
-char *C_extensions[] = {".c", ".cc", ".cxx", ".cpp", ".h", NULL};
-
-char *C_keywords[] = {
-    "switch",  "if",       "while",   "for",      "break",    "continue",
-    "return",  "else",     "struct",  "union",    "typedef",  "static",
-    "enum",    "class",    "case",    "volatile", "register", "sizeof",
-    "typedef", "union",    "goto",    "const",    "auto",     "#if",
-    "#endif",  "#error",   "#ifdef",  "#ifndef",  "#elif",    "#define",
-    "#undef",  "#include",
 
-    "int|",    "long|",    "double|", "float|",   "char|",    "unsigned|",
-    "signed|", "void|",    "bool|",   NULL,
+/* Screen cells carry an editor_highlight class or one of these */
+enum screen_attr {
+    ATTR_CONTROL = NUMBER + 1, /* control characters, in inverse video */
+    ATTR_STATUS,
+    ATTR_MESSAGE,
+    ATTR_COUNT,
 };
+/* clang-format on */
 
-editor_syntax DB[] = {
-    {"c", C_extensions, C_keywords, "//", "/*", "*/",
-     HIGHLIGHT_NUMBERS | HIGHLIGHT_STRINGS},
-};
+#define HIGHLIGHT_NUMBERS (1 << 0)
 
-#define DB_ENTRIES (sizeof(DB) / sizeof(DB[0]))
+/* Syntaxes loaded with -y come first, so that they win over the built-in */
+editor_syntax *syntaxes = NULL;
+int num_syntaxes = 0;
 
 void set_status_message(const char *msg, ...);
+void save_poll();
+void save_wait();
+void publish_view();
+void update_window_size();
+void close_buffer();
+void wait_input();
+void render_row(editor_row *row);
+size_t count_lines(const char *p, size_t len);
+
+/* Frames are only drawn when something marks the screen dirty, by writing
+ * a byte to this pipe.  The renderer drains it before each frame, so a burst
+ * of events costs one frame.
+ */
+int frame_pipe[2] = {-1, -1};
+
+void mark_dirty()
+{
+    char c = 0;
+    /* a full pipe means a frame is pending already */
+    write(frame_pipe[1], &c, 1);
+}
 char *prompt(char *msg, void (*callback)(char *, int));
 
 void clear_screen()
@@ -129,6 +220,7 @@ void open_buffer()
 
 void disable_raw_mode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &ec.orig_termios) == -1)
         panic("Failed to disable raw mode");
 }
@@ -144,72 +236,255 @@ void enable_raw_mode()
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
     open_buffer();
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         panic("Failed to set raw mode");
+    /* pastes come bracketed, rather than as if typed */
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int read_key()
+/* Ask the terminal what it supports, and wait for the answers.  DA1 goes
+ * last: every terminal answers it, so its reply means the others are in.
+ */
+#define PROBE_TIMEOUT 500 /* ms */
+
+/* Input is read in chunks of whatever is waiting, and decoded into keys
+ * from here.  Keys typed while probing the terminal are put here too.
+ */
+struct {
+    char buf[4096];
+    int len, pos;
+} input = {.len = 0, .pos = 0};
+
+/* Read what is waiting on stdin after the buffered input */
+int fill_input()
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if ((nread == -1) && (errno != EAGAIN))
-            panic("Error reading input");
-    }
-    if (c == '\x1b') {
-        char seq[3];
-        if ((read(STDIN_FILENO, &seq[0], 1) != 1) ||
-            (read(STDIN_FILENO, &seq[1], 1) != 1))
-            return '\x1b';
-        if (seq[0] == '[') {
-            if (isdigit(seq[1])) {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                    case '1':
-                    case '7':
-                        return HOME_KEY;
-                    case '4':
-                    case '8':
-                        return END_KEY;
-                    case '3':
-                        return DEL_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-                }
+    memmove(input.buf, &input.buf[input.pos], input.len - input.pos);
+    input.len -= input.pos;
+    input.pos = 0;
+    int n = read(STDIN_FILENO, &input.buf[input.len],
+                 sizeof(input.buf) - input.len);
+    if ((n == -1) && (errno != EAGAIN))
+        panic("Error reading input");
+    if (n <= 0)
+        return 0;
+    input.len += n;
+    return n;
+}
+
+/* Keep whatever in the probe replies is not a reply: DA1 and DECRPM are
+ * CSI ? ... c and CSI ? ... $ y, DECRQSS answers with a DCS string.
+ */
+void keep_typeahead(const char *reply, int len)
+{
+    for (int i = 0; i < len;) {
+        if (!strncmp(&reply[i], "\x1bP", 2)) {
+            const char *st = strstr(&reply[i], "\x1b\\");
+            i = st ? (st - reply) + 2 : len;
+            continue;
+        }
+        if (!strncmp(&reply[i], "\x1b[?", 3)) {
+            int end = i + 3 + strspn(&reply[i + 3], "0123456789;$");
+            if ((reply[end] == 'c') || (reply[end] == 'y')) {
+                i = end + 1;
+                continue;
             }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-            case 'H':
-                return HOME_KEY;
-            case 'F':
-                return END_KEY;
+        }
+        input.buf[input.len++] = reply[i++];
+    }
+}
+
+void probe_terminal()
+{
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm &&
+        (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit")))
+        ec.term |= TERM_TRUECOLOR;
+    const char query[] = "\x1b[?2026$p" /* DECRQM: synchronized output */
+                         /* DECRQSS: does the SGR keep a 24-bit color? */
+                         "\x1b[48;2;1;2;3m\x1bP$qm\x1b\\\x1b[m"
+                         "\x1b[c"; /* DA1 */
+    if (write(STDOUT_FILENO, query, sizeof(query) - 1) != sizeof(query) - 1)
+        return;
+    char reply[512];
+    int len = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (len < (int) sizeof(reply) - 1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if ((elapsed >= PROBE_TIMEOUT) ||
+            (poll(&pfd, 1, PROBE_TIMEOUT - elapsed) <= 0))
+            break;
+        int n = read(STDIN_FILENO, &reply[len], sizeof(reply) - 1 - len);
+        if (n <= 0)
+            continue;
+        len += n;
+        reply[len] = '\0';
+        /* the DA1 reply is CSI ? <digits and semicolons> c */
+        char *da = strstr(reply, "\x1b[?");
+        for (; da; da = strstr(da + 1, "\x1b[?")) {
+            char *end = da + 3 + strspn(da + 3, "0123456789;");
+            if (*end == 'c')
+                break;
+        }
+        if (da) {
+            ec.term |= TERM_SCROLL;
+            break;
+        }
+    }
+    reply[len] = '\0';
+    /* mode 2026 is known if reported set (1) or reset (2) */
+    if (strstr(reply, "\x1b[?2026;1$y") || strstr(reply, "\x1b[?2026;2$y"))
+        ec.term |= TERM_SYNC;
+    if (strstr(reply, "1:2:3m") || strstr(reply, "1;2;3m"))
+        ec.term |= TERM_TRUECOLOR;
+    keep_typeahead(reply, len);
+}
+
+/* Keys by the final byte of CSI and SS3 sequences, and by the number of
+ * CSI n ~ sequences
+ */
+const int csi_final[128] = {
+    ['A'] = ARROW_UP, ['B'] = ARROW_DOWN, ['C'] = ARROW_RIGHT,
+    ['D'] = ARROW_LEFT, ['H'] = HOME_KEY, ['F'] = END_KEY,
+};
+const int csi_tilde[] = {
+    [1] = HOME_KEY, [3] = DEL_KEY,   [4] = END_KEY,
+    [5] = PAGE_UP,  [6] = PAGE_DOWN, [7] = HOME_KEY, [8] = END_KEY,
+};
+#define CSI_TILDE_KEYS (sizeof(csi_tilde) / sizeof(csi_tilde[0]))
+
+/* Decode the key at the start of s, which holds len > 0 bytes.  Returns
+ * the number of bytes it takes, or 0 if the sequence is cut short.  The key
+ * is -1 for sequences of no known key.
+ */
+int decode_key(const char *s, int len, int *key)
+{
+    *key = (unsigned char) s[0];
+    if (s[0] != '\x1b')
+        return 1;
+    if (len < 2)
+        return 0;
+    if (s[1] == 'O') {
+        if (len < 3)
+            return 0;
+        *key = csi_final[s[2] & 0x7f] ? csi_final[s[2] & 0x7f] : -1;
+        return 3;
+    }
+    if (s[1] != '[')
+        return 1; /* ESC, then a key of its own */
+
+    /* CSI: parameter and intermediate bytes, then a final byte; xterm puts
+     * the modifiers in the second parameter, as 1 + shift, alt and ctrl bits
+     */
+    int param[2] = {0, 0}, n = 0, i = 2;
+    for (; (i < len) && ((s[i] < 0x40) || (s[i] > 0x7e)); i++) {
+        if ((s[i] < 0x20) || (s[i] > 0x3f))
+            return 1; /* not a sequence after all */
+        if (s[i] == ';')
+            n++;
+        else if (isdigit(s[i]) && (n < 2) && (param[n] < 10000))
+            param[n] = param[n] * 10 + s[i] - '0';
+    }
+    if (i == len)
+        return 0;
+    if ((s[i] == '~') && (param[0] == 200))
+        *key = PASTE_START;
+    else if (s[i] == '~')
+        *key = (param[0] < (int) CSI_TILDE_KEYS) ? csi_tilde[param[0]] : 0;
+    else
+        *key = csi_final[(int) s[i]];
+    if (!*key)
+        *key = -1;
+    else if (param[1] > 1)
+        *key |= ((param[1] - 1) & 7) * KEY_SHIFT;
+    return i + 1;
+}
+
+/* Whether a key is buffered, so that a burst is handled as one batch */
+bool input_pending()
+{
+    int key = -1, n = 1;
+    while ((input.pos < input.len) && (key == -1) && n) {
+        n = decode_key(&input.buf[input.pos], input.len - input.pos, &key);
+        if (key == -1)
+            input.pos += n;
+    }
+    return input.pos < input.len;
+}
+
+int read_key()
+{
+    while (1) {
+        int key, n = 0;
+        if (input.pos < input.len)
+            n = decode_key(&input.buf[input.pos], input.len - input.pos, &key);
+        if (!n) {
+            if (input.pos == input.len) {
+                wait_input();
+                fill_input();
+                continue;
             }
+            /* The rest of a sequence comes right after its start, or else
+             * that was the Escape key
+             */
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            if ((poll(&pfd, 1, ec.esc_timeout) > 0) && fill_input())
+                continue;
+            key = '\x1b';
+            n = 1;
+        }
+        input.pos += n;
+        if (key != -1)
+            return key;
+    }
+}
+
+/* Collect the text of a bracketed paste after PASTE_START, as is and
+ * without decoding keys, up to the closing CSI 201 ~
+ */
+char *read_paste(size_t *len)
+{
+    const char end_seq[] = "\x1b[201~";
+    const int end_len = sizeof(end_seq) - 1;
+    size_t size = 0, capacity = 4096;
+    char *text = malloc(capacity);
+    while (1) {
+        char *start = &input.buf[input.pos];
+        int avail = input.len - input.pos;
+        char *end = memmem(start, avail, end_seq, end_len);
+        /* the closing sequence may be cut short at the end of the buffer */
+        int take = end ? end - start
+                       : ((avail >= end_len) ? avail - end_len + 1 : 0);
+        if (size + take > capacity) {
+            while (size + take > capacity)
+                capacity *= 2;
+            text = realloc(text, capacity);
+        }
+        memcpy(&text[size], start, take);
+        size += take;
+        input.pos += take;
+        if (end) {
+            input.pos += end_len;
+            break;
         }
-        return '\x1b';
+        wait_input();
+        fill_input();
     }
-    return c;
+    /* terminals send line breaks as \r, some as \r\n */
+    size_t n = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (text[i] != '\r')
+            text[n++] = text[i];
+        else if ((i + 1 == size) || (text[i + 1] != '\n'))
+            text[n++] = '\n';
+    }
+    *len = n;
+    return text;
 }
 
 int get_window_size(int *screen_rows, int *screen_cols)
@@ -237,159 +512,1594 @@ void close_buffer()
     clear_screen();
 }
 
-bool is_token_separator(int c)
+static inline int row_count(editor_row *t)
 {
-    return isspace(c) || (c == '\0') || strchr(",.()+-/*=~%<>[]:;", c);
+    return t ? t->count : 0;
 }
 
-bool is_part_of_number(int c)
+void row_pull(editor_row *t)
 {
-    return c == '.' || c == 'x' || c == 'a' || c == 'b' || c == 'c' ||
-           c == 'd' || c == 'e' || c == 'f' || c == 'A' || c == 'X' ||
-           c == 'B' || c == 'C' || c == 'D' || c == 'E' || c == 'F' ||
-           c == 'h' || c == 'H';
+    t->count = 1 + row_count(t->left) + row_count(t->right);
+    if (t->left)
+        t->left->parent = t;
+    if (t->right)
+        t->right->parent = t;
 }
 
-void highlight(editor_row *row)
+/* Row text and render blocks come from size-classed slabs rather than from
+ * one malloc each: classes step by powers of two and halfway between them,
+ * from 16 bytes up to SLAB_MAX_BLOCK.  Larger blocks go to malloc but stay
+ * on a list, so that closing a buffer releases everything in bulk.
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_CLASSES 17
+#define SLAB_MAX_BLOCK 4096
+
+typedef struct large_block {
+    struct large_block *prev, *next;
+} large_block;
+
+struct slab_arena {
+    void *free[SLAB_CLASSES];
+    char *cursor[SLAB_CLASSES], *limit[SLAB_CLASSES];
+    void *slabs;       /* chained through their first word */
+    large_block large; /* circular list head */
+    size_t slab_bytes, used_bytes, free_bytes, large_bytes;
+} slab = {.large = {&slab.large, &slab.large}};
+
+static inline int slab_class(size_t size)
 {
-    row->highlight = realloc(row->highlight, row->render_size);
-    memset(row->highlight, NORMAL, row->render_size);
-    if (!ec.syntax)
+    if (size <= 16)
+        return 0;
+    int bits = 8 * sizeof(unsigned long) - __builtin_clzl(size - 1);
+    return (size <= ((size_t) 3 << (bits - 2))) ? 2 * (bits - 4) - 1
+                                                 : 2 * (bits - 4);
+}
+
+static inline size_t slab_class_size(int class)
+{
+    return (size_t) ((class & 1) ? 24 : 16) << (class / 2);
+}
+
+/* The number of bytes a request of the given size actually gets */
+static inline size_t slab_usable(size_t size)
+{
+    return (size > SLAB_MAX_BLOCK) ? size : slab_class_size(slab_class(size));
+}
+
+void *slab_alloc(size_t size)
+{
+    if (size > SLAB_MAX_BLOCK) {
+        large_block *b = malloc(sizeof(large_block) + size);
+        if (!b)
+            return NULL;
+        b->next = slab.large.next;
+        b->prev = &slab.large;
+        b->next->prev = b;
+        slab.large.next = b;
+        slab.large_bytes += size;
+        return b + 1;
+    }
+    int class = slab_class(size);
+    size_t block = slab_class_size(class);
+    void *p = slab.free[class];
+    if (p) {
+        slab.free[class] = *(void **) p;
+        slab.free_bytes -= block;
+    } else {
+        if (slab.cursor[class] + block > slab.limit[class]) {
+            char *s = malloc(SLAB_SIZE);
+            if (!s)
+                return NULL;
+            *(void **) s = slab.slabs;
+            slab.slabs = s;
+            slab.slab_bytes += SLAB_SIZE;
+            slab.cursor[class] = s + 16;
+            slab.limit[class] = s + SLAB_SIZE;
+        }
+        p = slab.cursor[class];
+        slab.cursor[class] += block;
+    }
+    slab.used_bytes += block;
+    return p;
+}
+
+void slab_free(void *p, size_t size)
+{
+    if (!p)
         return;
-    char **keywords = ec.syntax->keywords;
-    char *scs = ec.syntax->sl_comment_start;
-    char *mcs = ec.syntax->ml_comment_start;
-    char *mce = ec.syntax->ml_comment_end;
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-    bool prev_sep = true;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && ec.row[row->idx - 1].hl_open_comment);
-    int i = 0;
-    while (i < row->render_size) {
-        char c = row->render[i];
-        unsigned char prev_highlight = (i > 0) ? row->highlight[i - 1] : NORMAL;
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->highlight[i], SL_COMMENT, row->render_size - i);
+    if (size > SLAB_MAX_BLOCK) {
+        large_block *b = (large_block *) p - 1;
+        b->prev->next = b->next;
+        b->next->prev = b->prev;
+        slab.large_bytes -= size;
+        free(b);
+        return;
+    }
+    int class = slab_class(size);
+    *(void **) p = slab.free[class];
+    slab.free[class] = p;
+    slab.used_bytes -= slab_class_size(class);
+    slab.free_bytes += slab_class_size(class);
+}
+
+void *slab_realloc(void *p, size_t old_size, size_t size)
+{
+    if (!p)
+        return slab_alloc(size);
+    if ((old_size > SLAB_MAX_BLOCK) && (size > SLAB_MAX_BLOCK)) {
+        large_block *b = realloc((large_block *) p - 1, sizeof(*b) + size);
+        if (!b)
+            return NULL;
+        b->prev->next = b;
+        b->next->prev = b;
+        slab.large_bytes += size - old_size;
+        return b + 1;
+    }
+    if ((old_size <= SLAB_MAX_BLOCK) && (size <= SLAB_MAX_BLOCK) &&
+        (slab_class(old_size) == slab_class(size)))
+        return p;
+    void *new = slab_alloc(size);
+    if (new) {
+        memcpy(new, p, (old_size < size) ? old_size : size);
+        slab_free(p, old_size);
+    }
+    return new;
+}
+
+/* Drop every slab and large block at once */
+void slab_reset()
+{
+    while (slab.slabs) {
+        void *next = *(void **) slab.slabs;
+        free(slab.slabs);
+        slab.slabs = next;
+    }
+    while (slab.large.next != &slab.large) {
+        large_block *b = slab.large.next;
+        slab.large.next = b->next;
+        free(b);
+    }
+    slab = (struct slab_arena){.large = {&slab.large, &slab.large}};
+}
+
+/* Blocks that a save in flight may still be reading are freed once it ends */
+struct {
+    struct deferred_block {
+        void *p;
+        size_t size;
+    } *blocks;
+    int len, capacity;
+} deferred = {NULL, 0, 0};
+
+void slab_free_deferred(void *p, size_t size)
+{
+    if (deferred.len == deferred.capacity) {
+        deferred.capacity = deferred.capacity ? deferred.capacity * 2 : 64;
+        deferred.blocks = realloc(deferred.blocks,
+                                  deferred.capacity * sizeof(*deferred.blocks));
+    }
+    deferred.blocks[deferred.len++] = (struct deferred_block){p, size};
+}
+
+void slab_release_deferred()
+{
+    for (int i = 0; i < deferred.len; i++)
+        slab_free(deferred.blocks[i].p, deferred.blocks[i].size);
+    deferred.len = 0;
+}
+
+/* Row nodes never move, since the treap and the cursor point at them: they
+ * are carved out of blocks that are only released when the buffer closes,
+ * and deleted nodes are recycled through a free list.
+ */
+#define ROW_POOL_CHUNK 1024
+
+struct {
+    editor_row *free;
+    editor_row *cursor, *limit;
+    void **blocks;
+    int num_blocks;
+    size_t bytes;
+} row_pool = {NULL, NULL, NULL, NULL, 0, 0};
+
+editor_row *row_pool_block(size_t n)
+{
+    editor_row *block = calloc(n, sizeof(editor_row));
+    if (!block)
+        panic("Failed to allocate rows");
+    row_pool.blocks = realloc(row_pool.blocks,
+                              (row_pool.num_blocks + 1) * sizeof(void *));
+    row_pool.blocks[row_pool.num_blocks++] = block;
+    row_pool.bytes += n * sizeof(editor_row);
+    return block;
+}
+
+void row_pool_reset()
+{
+    for (int i = 0; i < row_pool.num_blocks; i++)
+        free(row_pool.blocks[i]);
+    free(row_pool.blocks);
+    memset(&row_pool, 0, sizeof(row_pool));
+}
+
+editor_row *row_alloc()
+{
+    editor_row *row = row_pool.free;
+    if (row) {
+        row_pool.free = row->left;
+        memset(row, 0, sizeof(editor_row));
+        return row;
+    }
+    if (row_pool.cursor == row_pool.limit) {
+        row_pool.cursor = row_pool_block(ROW_POOL_CHUNK);
+        row_pool.limit = row_pool.cursor + ROW_POOL_CHUNK;
+    }
+    return row_pool.cursor++;
+}
+
+void row_release(editor_row *row)
+{
+    row->left = row_pool.free;
+    row_pool.free = row;
+}
+
+editor_row *row_merge(editor_row *a, editor_row *b)
+{
+    if (!a || !b)
+        return a ? a : b;
+    if (a->priority > b->priority) {
+        a->right = row_merge(a->right, b);
+        row_pull(a);
+        return a;
+    }
+    b->left = row_merge(a, b->left);
+    row_pull(b);
+    return b;
+}
+
+/* Split the treap so that the first n rows end up in *a, the rest in *b */
+void row_split(editor_row *t, int n, editor_row **a, editor_row **b)
+{
+    if (!t) {
+        *a = *b = NULL;
+        return;
+    }
+    if (row_count(t->left) < n) {
+        row_split(t->right, n - row_count(t->left) - 1, &t->right, b);
+        *a = t;
+    } else {
+        row_split(t->left, n, a, &t->left);
+        *b = t;
+    }
+    row_pull(t);
+    t->parent = NULL;
+}
+
+int row_fixup(editor_row *t)
+{
+    if (!t)
+        return 0;
+    row_fixup(t->left);
+    row_fixup(t->right);
+    row_pull(t);
+    return t->count;
+}
+
+/* Build a treap over rows[0, n) in linear time, as a Cartesian tree on
+ * random priorities, instead of n separate insertions.
+ */
+editor_row *row_build(editor_row *rows, int n)
+{
+    int depth = 0, stack_size = 64;
+    editor_row **stack = malloc(stack_size * sizeof(*stack));
+    for (int i = 0; i < n; i++) {
+        editor_row *last = NULL;
+        rows[i].priority = rand();
+        while (depth && stack[depth - 1]->priority < rows[i].priority)
+            last = stack[--depth];
+        rows[i].left = last;
+        if (depth)
+            stack[depth - 1]->right = &rows[i];
+        if (depth == stack_size) {
+            stack_size *= 2;
+            stack = realloc(stack, stack_size * sizeof(*stack));
+        }
+        stack[depth++] = &rows[i];
+    }
+    editor_row *root = n ? stack[0] : NULL;
+    free(stack);
+    row_fixup(root);
+    if (root)
+        root->parent = NULL;
+    return root;
+}
+
+editor_row *row_at(int at)
+{
+    if ((at < 0) || (at >= ec.num_rows))
+        return NULL;
+    editor_row *t = ec.rows;
+    while (t) {
+        int left = row_count(t->left);
+        if (at < left)
+            t = t->left;
+        else if (at == left)
+            break;
+        else {
+            at -= left + 1;
+            t = t->right;
+        }
+    }
+    return t;
+}
+
+int row_index(editor_row *row)
+{
+    int idx = row_count(row->left);
+    for (; row->parent; row = row->parent) {
+        if (row->parent->right == row)
+            idx += row_count(row->parent->left) + 1;
+    }
+    return idx;
+}
+
+editor_row *row_next(editor_row *row)
+{
+    if (row->right) {
+        for (row = row->right; row->left; row = row->left)
+            ;
+        return row;
+    }
+    while (row->parent && row->parent->right == row)
+        row = row->parent;
+    return row->parent;
+}
+
+editor_row *row_prev(editor_row *row)
+{
+    if (row->left) {
+        for (row = row->left; row->right; row = row->right)
+            ;
+        return row;
+    }
+    while (row->parent && row->parent->left == row)
+        row = row->parent;
+    return row->parent;
+}
+
+static inline char row_char(editor_row *row, int at)
+{
+    return (at < row->gap) ? row->chars[at]
+                           : row->chars[at + row->capacity - row->size];
+}
+
+static inline char *row_tail(editor_row *row)
+{
+    return &row->chars[row->gap + row->capacity - row->size];
+}
+
+void row_reserve(editor_row *row, int size);
+
+static inline bool row_pinned(editor_row *row)
+{
+    return saving && (row->flags & ROW_PINNED);
+}
+
+/* Copy on write for text that the save in flight still refers to.  Bytes
+ * past the end of the line are not part of the snapshot, so typing at the
+ * end of a pinned row does not need this, as long as the row has not been
+ * made shorter first.
+ */
+void row_unpin(editor_row *row)
+{
+    char *chars = slab_alloc(row->capacity);
+    memcpy(chars, row->chars, row->capacity);
+    slab_free_deferred(row->chars, row->capacity);
+    row->chars = chars;
+    row->flags &= ~ROW_PINNED;
+    if (row->flags & ROW_SHARED)
+        row->render = row->chars;
+}
+
+void row_move_gap(editor_row *row, int at)
+{
+    if (!row->capacity)
+        row_reserve(row, row->size);
+    if ((at != row->gap) && row_pinned(row))
+        row_unpin(row);
+    int gap_len = row->capacity - row->size;
+    if (at < row->gap)
+        memmove(&row->chars[at + gap_len], &row->chars[at], row->gap - at);
+    else if (at > row->gap)
+        memmove(&row->chars[row->gap], &row->chars[row->gap + gap_len],
+                at - row->gap);
+    row->gap = at;
+}
+
+/* Make room for a line of the given size plus the terminating NUL */
+void row_reserve(editor_row *row, int size)
+{
+    if (size < row->capacity)
+        return;
+    int capacity = row->capacity ? row->capacity : 16;
+    while (capacity <= size)
+        capacity *= 2;
+    capacity = slab_usable(capacity);
+    if (!row->capacity) {
+        /* copy on first write: the file mapping is never modified */
+        char *chars = slab_alloc(capacity);
+        memcpy(chars, row->chars, row->size);
+        row->chars = chars;
+        row->gap = row->size;
+    } else {
+        row_move_gap(row, row->size);
+        if (row_pinned(row))
+            row_unpin(row);
+        row->chars = slab_realloc(row->chars, row->capacity, capacity);
+    }
+    row->capacity = capacity;
+    if (row->flags & ROW_SHARED)
+        row->render = row->chars;
+}
+
+/* Close the gap and return the line as a NUL-terminated string */
+char *row_text(editor_row *row)
+{
+    row_move_gap(row, row->size);
+    row->chars[row->size] = '\0';
+    return row->chars;
+}
+
+/* Like row_text(), but rows borrowing from the mapping are left alone */
+char *row_contiguous(editor_row *row)
+{
+    if (row->capacity)
+        row_move_gap(row, row->size);
+    return row->chars;
+}
+
+/* Classes of bytes for the lexer, looked up in a table of the syntax */
+#define CC_SEPARATOR (1 << 0) /* ends a token */
+#define CC_NUMBER (1 << 1)    /* goes on with a number, past its first digit */
+#define CC_WORD (1 << 2)      /* no effect inside a word: skipped over */
+#define CC_BLANK (1 << 3)     /* no effect between words: skipped over */
+
+static inline int char_class(const char *text, int i)
+{
+    return ec.syntax->char_class[(unsigned char) text[i]];
+}
+
+/* Skip the run of bytes with the class cls from text[i].  Blanks, and
+ * identifier bytes when the syntax lets them all be skipped, are measured
+ * 16 bytes at a time; the rest of the run is finished byte by byte.
+ */
+int skip_class(const char *text, int i, int len, int cls)
+{
+#ifdef __SSE2__
+    if ((cls == CC_BLANK) || ec.syntax->simd_words) {
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (text + i));
+            __m128i in;
+            if (cls == CC_BLANK) {
+                in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+            } else {
+                /* letters, digits, '_' and the bytes of UTF-8 sequences */
+                __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                in = _mm_and_si128(
+                    _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+                in = _mm_or_si128(
+                    in, _mm_and_si128(
+                            _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                            _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+                in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+                in = _mm_or_si128(in, _mm_cmplt_epi8(v, _mm_setzero_si128()));
+            }
+            int mask = _mm_movemask_epi8(in);
+            if (mask != 0xffff) {
+                i += __builtin_ctz(~mask);
                 break;
             }
         }
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->highlight[i] = ML_COMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->highlight[i], ML_COMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = true;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->highlight[i], ML_COMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
+    }
+#endif
+    while ((i < len) && (char_class(text, i) & cls))
+        i++;
+    return i;
+}
+
+/* Keywords are looked up by a hash of the whole token, which cannot hold
+ * a separator.  The seed and size of the table are picked when it is built
+ * so that no two keywords share a slot: the hash is perfect, and a lookup
+ * is one hash of the token and one comparison.
+ */
+struct keyword_table {
+    struct {
+        const char *word;
+        int len;
+        unsigned char highlight;
+    } *slots;
+    unsigned mask, seed;
+    int max_len;
+};
+
+static inline unsigned keyword_hash(const char *s, int len, unsigned seed)
+{
+    unsigned h = seed; /* FNV-1a */
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 16777619;
+    return h;
+}
+
+/* A trailing '|' marks KEYWORD_2, a leading '#' KEYWORD_3 */
+struct keyword_table *keywords_compile(char **keywords)
+{
+    struct keyword_table *kt = calloc(1, sizeof(*kt));
+    int n = 0;
+    while (keywords[n])
+        n++;
+    unsigned size = 2;
+    while (size < 2 * (unsigned) n)
+        size *= 2;
+    for (unsigned tries = 0;; tries++) {
+        /* grow the table if no seed comes out collision-free */
+        if (tries && !(tries % 64))
+            size *= 2;
+        kt->slots = realloc(kt->slots, size * sizeof(*kt->slots));
+        memset(kt->slots, 0, size * sizeof(*kt->slots));
+        kt->mask = size - 1;
+        kt->seed = 2166136261u + tries;
+        int i;
+        for (i = 0; i < n; i++) {
+            const char *word = keywords[i];
+            int len = strlen(word);
+            bool kw_2 = word[len - 1] == '|';
+            if (kw_2)
+                len--;
+            if (len > kt->max_len)
+                kt->max_len = len;
+            int highlight = (word[0] == '#') ? KEYWORD_3 : KEYWORD_1;
+            if (kw_2)
+                highlight = KEYWORD_2;
+            unsigned slot = keyword_hash(word, len, kt->seed) & kt->mask;
+            if (!kt->slots[slot].word) {
+                kt->slots[slot].word = word;
+                kt->slots[slot].len = len;
+                kt->slots[slot].highlight = highlight;
+            } else if ((kt->slots[slot].len != len) ||
+                       memcmp(kt->slots[slot].word, word, len))
+                break; /* a collision, not a duplicate */
+        }
+        if (i == n)
+            return kt;
+    }
+}
+
+/* The highlight of the keyword that text[0, len) starts with, or NORMAL */
+int keyword_lookup(struct keyword_table *kt, const char *text, int len,
+                   int *kw_len)
+{
+    int n = 0;
+    while ((n < len) && (n <= kt->max_len) &&
+           !(char_class(text, n) & CC_SEPARATOR))
+        n++;
+    if (!n || (n > kt->max_len))
+        return NORMAL;
+    unsigned slot = keyword_hash(text, n, kt->seed) & kt->mask;
+    if (!kt->slots[slot].word || (kt->slots[slot].len != n) ||
+        memcmp(kt->slots[slot].word, text, n))
+        return NORMAL;
+    *kw_len = n;
+    return kt->slots[slot].highlight;
+}
+
+/* A syntax is lexed in contexts: the code, and a context for each kind of
+ * span (comment, string, here-document) that the text may be in.  Each
+ * context only looks for the delimiters that change it.  Those are compiled
+ * into one DFA: the states of a context form an Aho-Corasick automaton over
+ * its delimiters, whose transitions are resolved into a table indexed by
+ * state and by class of byte.  Bytes found in no delimiter are class 0,
+ * which takes every state back to the root of its context, so the cost of
+ * a byte is one lookup whatever the syntax defines.
+ */
+enum lexer_action {
+    LEX_PLAIN,   /* only looks like a delimiter: nothing happens */
+    LEX_LINE,    /* the rest of the line is a comment */
+    LEX_OPEN,    /* enter the span of context target */
+    LEX_CLOSE,   /* leave the span, or one level of it */
+    LEX_NEST,    /* the span opens again inside itself */
+    LEX_ESCAPE,  /* the next byte is taken as it is */
+    LEX_HEREDOC, /* a word follows, which alone on a line ends the span */
+};
+
+struct lexer_rule {
+    char *text;
+    unsigned char len, action, attr, context, target;
+};
+
+#define LEX_CONTEXTS 64
+#define LEX_RULES 255
+
+#define SPAN_MULTILINE (1 << 0)
+#define SPAN_HEREDOC (1 << 1)
+
+struct lexer {
+    struct lexer_rule rules[LEX_RULES];
+    int num_rules;
+    struct {
+        unsigned short root;
+        unsigned char attr, flags;
+    } contexts[LEX_CONTEXTS];
+    int num_contexts;
+    unsigned char cls[256];
+    int num_cls;
+    unsigned short *next;  /* [state * num_cls + class] */
+    unsigned char *depth;  /* bytes of a delimiter that the state has seen */
+    unsigned char *accept; /* 1 + the rule matched on entering, or 0 */
+};
+
+/* The lexer state at a line boundary: the context, how deep a nesting span
+ * is, and a hash of the word that ends a here-document.  0 is plain code.
+ */
+#define LEX_STATE(context, depth, hash) \
+    ((context) | ((depth) << 8) | ((hash) << 12))
+#define LEX_CONTEXT(state) ((state) & 0xff)
+#define LEX_DEPTH(state) (((state) >> 8) & 0xf)
+#define LEX_HASH(state) ((state) >> 12)
+#define LEX_MAX_DEPTH 15
+
+static inline unsigned heredoc_hash(const char *s, int len)
+{
+    return keyword_hash(s, len, 2166136261u) & 0xfffff;
+}
+
+void lexer_compile(struct lexer *lx)
+{
+    int max_states = lx->num_contexts;
+    for (int r = 0; r < lx->num_rules; r++)
+        max_states += lx->rules[r].len;
+    /* the trie of each context; 0 is never a child, so it means none */
+    int(*go)[256] = calloc(max_states, sizeof(*go));
+    int *fail = malloc(max_states * sizeof(int));
+    int *owner = malloc(max_states * sizeof(int));
+    lx->depth = calloc(max_states, 1);
+    lx->accept = calloc(max_states, 1);
+    int n = 0;
+    for (int c = 0; c < lx->num_contexts; c++) {
+        owner[n] = c;
+        lx->contexts[c].root = n++;
+    }
+    for (int r = 0; r < lx->num_rules; r++) {
+        struct lexer_rule *rule = &lx->rules[r];
+        int state = lx->contexts[rule->context].root;
+        for (int i = 0; i < rule->len; i++) {
+            unsigned char b = rule->text[i];
+            if (!go[state][b]) {
+                owner[n] = rule->context;
+                lx->depth[n] = lx->depth[state] + 1;
+                go[state][b] = n++;
             }
+            state = go[state][b];
         }
-        if (ec.syntax->flags & HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->highlight[i] = STRING;
-                if ((c == '\\') && (i + 1 < row->render_size)) {
-                    row->highlight[i + 1] = STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string)
-                    in_string = 0;
+        if (!lx->accept[state])
+            lx->accept[state] = r + 1;
+    }
+
+    /* Breadth first, so that the fail link of a state, which is shallower,
+     * is resolved before the state itself.  A state also matches what its
+     * fail link matches: the longest delimiter that ends there.
+     */
+    int *queue = malloc(n * sizeof(int)), head = 0, tail = 0;
+    for (int c = 0; c < lx->num_contexts; c++) {
+        int root = lx->contexts[c].root;
+        for (int b = 0; b < 256; b++) {
+            if (go[root][b]) {
+                fail[go[root][b]] = root;
+                queue[tail++] = go[root][b];
+            } else
+                go[root][b] = root;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        if (!lx->accept[state])
+            lx->accept[state] = lx->accept[fail[state]];
+        for (int b = 0; b < 256; b++) {
+            int child = go[state][b];
+            if (child) {
+                fail[child] = go[fail[state]][b];
+                queue[tail++] = child;
+            } else
+                go[state][b] = go[fail[state]][b];
+        }
+    }
+
+    /* Bytes that take every state to the same place share a class */
+    int rep[256];
+    lx->num_cls = 1;
+    for (int b = 0; b < 256; b++) {
+        bool plain = true;
+        for (int i = 0; plain && (i < n); i++)
+            plain = (go[i][b] == lx->contexts[owner[i]].root);
+        int k = plain ? 0 : 1;
+        for (; !plain && (k < lx->num_cls); k++) {
+            int i = 0;
+            while ((i < n) && (go[i][b] == go[i][rep[k]]))
                 i++;
+            if (i == n)
+                break;
+        }
+        if (k == lx->num_cls)
+            rep[lx->num_cls++] = b;
+        lx->cls[b] = k;
+    }
+    lx->next = malloc(n * lx->num_cls * sizeof(*lx->next));
+    for (int i = 0; i < n; i++) {
+        lx->next[i * lx->num_cls] = lx->contexts[owner[i]].root;
+        for (int k = 1; k < lx->num_cls; k++)
+            lx->next[i * lx->num_cls + k] = go[i][rep[k]];
+    }
+    free(go);
+    free(fail);
+    free(owner);
+    free(queue);
+}
+
+/* The rule that state matches at text[at], or a longer delimiter that goes
+ * on from there.  *end is set to the last byte of the match.
+ */
+struct lexer_rule *lexer_match(struct lexer *lx, int state, const char *text,
+                               int len, int at, int *end)
+{
+    struct lexer_rule *rule = &lx->rules[lx->accept[state] - 1];
+    *end = at;
+    for (int i = at + 1; i < len; i++) {
+        int next = lx->next[state * lx->num_cls +
+                            lx->cls[(unsigned char) text[i]]];
+        if (lx->depth[next] != lx->depth[state] + 1)
+            break; /* not a longer delimiter */
+        state = next;
+        if (lx->accept[state] &&
+            (lx->rules[lx->accept[state] - 1].len == lx->depth[state])) {
+            rule = &lx->rules[lx->accept[state] - 1];
+            *end = i;
+        }
+    }
+    return rule;
+}
+
+/* Take the word after the "<<" that ends at text[at - 1], in any of the
+ * forms <<WORD, <<-WORD, << WORD or <<'WORD'.  Returns where the word ends,
+ * or at if there is none, as in $((1<<3)).
+ */
+int heredoc_open(const char *text, int len, int at, unsigned *hash)
+{
+    int i = at;
+    if ((i < len) && ((text[i] == '-') || (text[i] == '~')))
+        i++;
+    while ((i < len) && isblank(text[i]))
+        i++;
+    char quote = ((i < len) && strchr("\"'", text[i])) ? text[i++] : '\0';
+    int word = i;
+    while ((i < len) && (isalnum(text[i]) || (text[i] == '_')))
+        i++;
+    if ((i == word) || (!quote && isdigit(text[word])))
+        return at;
+    *hash = heredoc_hash(&text[word], i - word);
+    if (quote && (i < len) && (text[i] == quote))
+        i++;
+    return i;
+}
+
+/* Bytes of delimiters are never skipped over */
+void syntax_compile(editor_syntax *es)
+{
+    lexer_compile(es->lexer);
+    for (int c = 0; c < 256; c++) {
+        unsigned char cls = 0;
+        if (isspace(c) || !c || strchr(",.()+-/*=~%<>[]:;", c))
+            cls |= CC_SEPARATOR;
+        if (c && strchr(".xXabcdefABCDEFhH", c))
+            cls |= CC_NUMBER;
+        bool special = es->lexer->cls[c];
+        if (!special && !(cls & CC_SEPARATOR))
+            cls |= CC_WORD;
+        if (!special && ((c == ' ') || (c == '\t')))
+            cls |= CC_BLANK;
+        es->char_class[c] = cls;
+    }
+    es->simd_words = true;
+    for (int c = 0; c < 256; c++) {
+        if ((isalnum(c) || (c == '_') || (c >= 0x80)) &&
+            !(es->char_class[c] & CC_WORD))
+            es->simd_words = false;
+    }
+    es->keyword_table = keywords_compile(es->keywords);
+}
+
+/* Lex text[0, len) into hl, from the lexer state at the start of the line,
+ * and return the state at its end.
+ */
+unsigned highlight_line(const char *text, int len, unsigned char *hl,
+                        unsigned state)
+{
+    memset(hl, NORMAL, len);
+    if (!ec.syntax)
+        return 0;
+    struct lexer *lx = ec.syntax->lexer;
+    struct keyword_table *keywords = ec.syntax->keyword_table;
+    int context = LEX_CONTEXT(state), depth = LEX_DEPTH(state);
+    int attr = lx->contexts[context].attr;
+    if (lx->contexts[context].flags & SPAN_HEREDOC) {
+        /* the body of a here-document goes on up to the line of its word */
+        memset(hl, attr, len);
+        int start = 0;
+        while ((start < len) && isspace(text[start]))
+            start++;
+        while ((len > start) && isspace(text[len - 1]))
+            len--;
+        if (heredoc_hash(&text[start], len - start) == LEX_HASH(state))
+            return 0;
+        return state;
+    }
+    unsigned heredoc = 0; /* the state the next line starts in, if any */
+    int dfa = lx->contexts[context].root;
+    bool prev_sep = true;
+    int i = 0;
+    while (i < len) {
+        char c = text[i];
+        unsigned char cls = lx->cls[(unsigned char) c];
+        unsigned char prev_highlight = (i > 0) ? hl[i - 1] : NORMAL;
+        if (context && !cls) {
+            /* a span holds nothing else up to its next delimiter */
+            int start = i;
+            while ((i < len) && !lx->cls[(unsigned char) text[i]])
+                i++;
+            memset(&hl[start], attr, i - start);
+            dfa = lx->contexts[context].root;
+            continue;
+        }
+        if (!context) {
+            /* runs of blanks, and of word bytes past the start of a word,
+             * change nothing but where the scan is
+             */
+            if (char_class(text, i) & CC_BLANK) {
+                i = skip_class(text, i, len, CC_BLANK);
                 prev_sep = true;
+                dfa = lx->contexts[0].root;
                 continue;
-            } else {
-                if ((c == '"') || (c == '\'')) {
-                    in_string = c;
-                    row->highlight[i] = STRING;
-                    i++;
-                    continue;
+            }
+            if (!prev_sep && (prev_highlight != NUMBER) &&
+                (char_class(text, i) & CC_WORD)) {
+                i = skip_class(text, i, len, CC_WORD);
+                dfa = lx->contexts[0].root;
+                continue;
+            }
+        }
+        dfa = lx->next[dfa * lx->num_cls + cls];
+        if (lx->accept[dfa]) {
+            int end;
+            struct lexer_rule *rule = lexer_match(lx, dfa, text, len, i, &end);
+            int start = end - rule->len + 1;
+            i = end + 1;
+            switch (rule->action) {
+            case LEX_LINE:
+                memset(&hl[start], rule->attr, len - start);
+                i = len;
+                break;
+            case LEX_OPEN:
+                context = rule->target;
+                depth = 0;
+                attr = rule->attr;
+                memset(&hl[start], attr, i - start);
+                break;
+            case LEX_NEST:
+                if (depth < LEX_MAX_DEPTH)
+                    depth++;
+                memset(&hl[start], attr, i - start);
+                break;
+            case LEX_CLOSE:
+                memset(&hl[start], attr, i - start);
+                if (depth)
+                    depth--;
+                else {
+                    context = 0;
+                    attr = NORMAL;
+                    prev_sep = true;
                 }
+                break;
+            case LEX_ESCAPE:
+                if (i < len)
+                    i++;
+                memset(&hl[start], attr, i - start);
+                break;
+            case LEX_HEREDOC: {
+                unsigned hash;
+                int word_end = heredoc_open(text, len, i, &hash);
+                if (word_end == i)
+                    break; /* a shift, or a here-string */
+                heredoc = LEX_STATE(rule->target, 0, hash);
+                memset(&hl[start], rule->attr, word_end - start);
+                i = word_end;
+                break;
+            }
+            default:
+                prev_sep = false;
+                break;
             }
+            dfa = lx->contexts[context].root;
+            continue;
+        }
+        if (context) {
+            hl[i++] = attr;
+            continue;
         }
         if (ec.syntax->flags & HIGHLIGHT_NUMBERS) {
             if ((isdigit(c) && (prev_sep || (prev_highlight == NUMBER))) ||
-                (is_part_of_number(c) && (prev_highlight == NUMBER))) {
-                row->highlight[i] = NUMBER;
+                ((char_class(text, i) & CC_NUMBER) &&
+                 (prev_highlight == NUMBER))) {
+                hl[i] = NUMBER;
                 i++;
                 prev_sep = false;
                 continue;
             }
         }
         if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int kw_len = strlen(keywords[j]);
-                bool kw_2 = keywords[j][kw_len - 1] == '|';
-                /* FIXME: specific to C/C++, should be generic */
-                bool kw_3 = keywords[j][0] == '#';
-                if (kw_2)
-                    kw_len--;
-                if (!strncmp(&row->render[i], keywords[j], kw_len) &&
-                    is_token_separator(row->render[i + kw_len])) {
-                    memset(&row->highlight[i],
-                           kw_2 ? KEYWORD_2 : (kw_3 ? KEYWORD_3 : KEYWORD_1),
-                           kw_len);
-                    i += kw_len;
-                    break;
-                }
-            }
-            if (keywords[j]) {
+            int kw_len;
+            int kw = keyword_lookup(keywords, &text[i], len - i, &kw_len);
+            if (kw != NORMAL) {
+                memset(&hl[i], kw, kw_len);
+                i += kw_len;
                 prev_sep = false;
+                dfa = lx->contexts[0].root;
                 continue;
             }
         }
-        prev_sep = is_token_separator(c);
+        prev_sep = char_class(text, i) & CC_SEPARATOR;
         i++;
     }
-    bool changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < ec.num_rows)
-        highlight(&ec.row[row->idx + 1]);
-}
-
-/* Reference: https://misc.flogisoft.com/bash/tip_colors_and_formatting */
-int token_to_color(int highlight)
-{
-    switch (highlight) {
-    case SL_COMMENT:
-    case ML_COMMENT:
-        return 36; /* Cyan */
-    case KEYWORD_1:
-        return 93; /* Light yellow */
-    case KEYWORD_2:
-        return 92; /* Light green */
-    case KEYWORD_3:
-        return 36; /* Cyan */
-    case STRING:
-        return 91; /* Light red */
-    case NUMBER:
-        return 31; /* Red */
-    case MATCH:
-        return 35; /* Magenta */
-    default:
-        return 97;
+    if (context && !(lx->contexts[context].flags & SPAN_MULTILINE))
+        context = depth = 0;
+    return context ? LEX_STATE(context, depth, 0) : heredoc;
+}
+
+static inline void lexed_from(editor_row *row, unsigned state)
+{
+    row->flags |= ROW_LEXED;
+    row->hl_start = state;
+}
+
+/* Rows at or past hl_frontier have not been checked since something above
+ * them changed, so their hl_state may be stale.
+ */
+void highlight(editor_row *row, unsigned state)
+{
+    row->hl_state = highlight_line(row->render, row->render_size,
+                                   row->highlight, state);
+    row->flags |= ROW_HIGHLIGHT;
+    lexed_from(row, state);
+}
+
+/* Only the end-of-line state is wanted: lex the raw text into scratch space.
+ * The row's gap must be closed, or the text not owned by the row at all.
+ */
+void highlight_state(editor_row *row, unsigned state)
+{
+    static unsigned char *scratch = NULL;
+    static int scratch_size = 0;
+    if (row->size > scratch_size) {
+        scratch_size = row->size;
+        scratch = realloc(scratch, scratch_size);
+    }
+    row->hl_state = highlight_line(row->chars, row->size, scratch, state);
+    lexed_from(row, state);
+}
+
+/* Lex a row again if its text or start state changed.  Returns whether the
+ * colors it already had on screen were redone.
+ */
+bool relex_row(editor_row *row, unsigned state)
+{
+    if ((row->flags & ROW_LEXED) && (row->hl_start == state))
+        return false;
+    bool rendered = row->flags & ROW_RENDER;
+    if (!rendered && (row->gap == row->size)) {
+        highlight_state(row, state);
+        return false;
+    }
+    /* A row with its gap open, which is the row being typed in, is lexed
+     * from its render: joining its text would move the tail out of the gap,
+     * only for the next key to move it back.
+     */
+    if (!rendered)
+        render_row(row);
+    highlight(row, state);
+    return rendered;
+}
+
+/* One step of the walk that brings hl_frontier down: the row at it, which
+ * starts in state, is lexed again if need be.  Past hl_dirty, every row was
+ * lexed from the state the row above it ended in, so the first of them that
+ * still starts in the right state ends the walk for the whole buffer.
+ * Returns whether the colors the row had on screen were redone.
+ */
+bool highlight_step(editor_row *row, unsigned state)
+{
+    if ((ec.hl_frontier >= ec.hl_dirty) && (row->flags & ROW_LEXED) &&
+        (row->hl_start == state)) {
+        ec.hl_frontier = ec.num_rows;
+        ec.hl_dirty = 0;
+        return false;
+    }
+    bool redone = relex_row(row, state);
+    /* the row below may now start in another state */
+    ec.hl_frontier++;
+    if (ec.hl_frontier == ec.num_rows)
+        ec.hl_dirty = 0; /* the walk is done */
+    else if (ec.hl_dirty < ec.hl_frontier)
+        ec.hl_dirty = ec.hl_frontier;
+    return redone;
+}
+
+/* Bring hl_frontier past the row at index at.  This is a walk, not a
+ * recursion: only rows whose text or start state changed are lexed again.
+ */
+bool highlight_sync(int at)
+{
+    bool redone = false;
+    if ((at < ec.hl_frontier) || (ec.hl_frontier >= ec.num_rows))
+        return redone;
+    editor_row *row = row_at(ec.hl_frontier);
+    editor_row *prev = row_prev(row);
+    unsigned state = prev ? prev->hl_state : 0;
+    for (; row && ec.hl_frontier <= at; row = row_next(row)) {
+        redone |= highlight_step(row, state);
+        state = row->hl_state;
     }
+    return redone;
+}
+
+/* The text of the rows at..end - 1 changed */
+void highlight_invalidate(int at, int end)
+{
+    if (at < ec.hl_frontier)
+        ec.hl_frontier = at;
+    if (end > ec.hl_dirty)
+        ec.hl_dirty = end;
+}
+
+/* n rows were inserted at at, or -n rows were removed from there */
+void highlight_shift(int at, int n)
+{
+    if (ec.hl_dirty > at)
+        ec.hl_dirty += n;
+    highlight_invalidate(at, at + ((n > 0) ? n : 1));
+}
+
+/* Rows further than this past hl_frontier are not lexed up to before a
+ * frame.  What is on screen is lexed from a guess made this many rows
+ * above it instead, and put right by the worker if the guess was wrong.
+ */
+#define HL_GUESS_ROWS 1024
+
+/* Give the rows first..last a lexer state, exact or guessed */
+void highlight_view(int first, int last)
+{
+    if (first - ec.hl_frontier <= HL_GUESS_ROWS) {
+        highlight_sync(last);
+        return;
+    }
+    int at = first - HL_GUESS_ROWS;
+    editor_row *row = row_at(at);
+    if (!row)
+        return;
+    /* keep whatever start state the first row was last lexed from */
+    unsigned state = (row->flags & ROW_LEXED) ? row->hl_start : 0;
+    for (; row && at <= last; row = row_next(row), at++) {
+        relex_row(row, state);
+        state = row->hl_state;
+    }
+    /* the guess is only right if the walk finds it so */
+    highlight_invalidate(ec.hl_frontier, at);
+}
+
+/* Bytes of text the worker lexes before it shows what it redid */
+#define HL_SLICE_BYTES (64 * 1024)
+
+/* Rows past the view are lexed by a worker, which may only touch them while
+ * it holds lock.  The editing thread keeps the lock for itself except while
+ * it waits for input, so the worker runs in the gaps between keys.  An edit
+ * that moves hl_frontier back restarts it from there, for as long as the end
+ * states of the rows keep changing.
+ */
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t resume;
+    bool wanted; /* the editing thread waits for the lock */
+} lexer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false};
+
+void lexer_acquire()
+{
+    __atomic_store_n(&lexer.wanted, true, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&lexer.lock);
+    __atomic_store_n(&lexer.wanted, false, __ATOMIC_RELAXED);
+}
+
+void lexer_release()
+{
+    pthread_cond_signal(&lexer.resume);
+    pthread_mutex_unlock(&lexer.lock);
+}
+
+/* The walk of highlight_sync(), made by the worker in slices.  It gives way
+ * as soon as the editing thread wants the lock, after the row at hand: a
+ * slice of a few long lines would otherwise hold up a key for a while.
+ * Returns whether a guess on screen proved wrong and was redone.
+ */
+bool lexer_slice()
+{
+    bool redone = false;
+    editor_row *row = row_at(ec.hl_frontier);
+    editor_row *prev = row_prev(row);
+    unsigned state = prev ? prev->hl_state : 0;
+    size_t len = 0;
+    while (row && (ec.hl_frontier < ec.num_rows) && (len < HL_SLICE_BYTES)) {
+        redone |= highlight_step(row, state);
+        state = row->hl_state;
+        len += row->size + 1;
+        if (__atomic_load_n(&lexer.wanted, __ATOMIC_RELAXED))
+            break;
+        row = row_next(row);
+    }
+    return redone;
+}
+
+void *lexer_thread(void *dummy)
+{
+    /* the nice value is per thread on Linux */
+    setpriority(PRIO_PROCESS, 0, 19);
+    pthread_mutex_lock(&lexer.lock);
+    while (1) {
+        while (__atomic_load_n(&lexer.wanted, __ATOMIC_RELAXED) ||
+               !ec.syntax || (ec.hl_frontier >= ec.num_rows))
+            pthread_cond_wait(&lexer.resume, &lexer.lock);
+        if (lexer_slice())
+            publish_view();
+    }
+    return NULL;
+}
+
+/* A theme gives the SGR parameters of each screen attribute.  The renderer
+ * only ever looks at the escape sequences built from it, which start from a
+ * reset, so switching attributes needs no other terminal state.
+ * Reference: https://misc.flogisoft.com/bash/tip_colors_and_formatting
+ */
+#define SGR_PARAMS 48
+
+struct {
+    char params[ATTR_COUNT][SGR_PARAMS];
+    struct {
+        char seq[SGR_PARAMS + 8];
+        int len;
+    } sgr[ATTR_COUNT];
+} theme = {.params = {
+               [NORMAL] = "",
+               [MATCH] = "35",      /* Magenta */
+               [SL_COMMENT] = "36", /* Cyan */
+               [ML_COMMENT] = "36", /* Cyan */
+               [KEYWORD_1] = "93",  /* Light yellow */
+               [KEYWORD_2] = "92",  /* Light green */
+               [KEYWORD_3] = "36",  /* Cyan */
+               [STRING] = "91",     /* Light red */
+               [NUMBER] = "31",     /* Red */
+               [ATTR_CONTROL] = "7",
+               [ATTR_STATUS] = "100", /* Dark gray */
+               [ATTR_MESSAGE] = "93;44",
+           }};
+
+const char *attr_names[ATTR_COUNT] = {
+    "normal",   "match",    "sl_comment", "ml_comment",
+    "keyword1", "keyword2", "keyword3",   "string",
+    "number",   "control",  "status",     "message",
+};
+
+/* Nearest color of the 6x6x6 cube in the 256-color palette */
+int rgb_to_256(int r, int g, int b)
+{
+    int c[3] = {r, g, b};
+    for (int i = 0; i < 3; i++)
+        c[i] = (c[i] < 48) ? 0 : (c[i] < 115) ? 1 : (c[i] - 35) / 40;
+    return 16 + 36 * c[0] + 6 * c[1] + c[2];
+}
+
+/* Copy SGR parameters, turning 24-bit colors into 256-color ones */
+void sgr_downgrade(const char *params, char *out, size_t size)
+{
+    int len = 0;
+    out[0] = '\0';
+    while (*params && (len < (int) size)) {
+        int fg_bg, r, g, b, n = 0;
+        if ((sscanf(params, "%d;2;%d;%d;%d%n", &fg_bg, &r, &g, &b, &n) == 4) &&
+            ((fg_bg == 38) || (fg_bg == 48))) {
+            len += snprintf(&out[len], size - len, "%d;5;%d", fg_bg,
+                            rgb_to_256(r, g, b));
+            params += n;
+        } else {
+            n = strcspn(params, ";");
+            len += snprintf(&out[len], size - len, "%.*s", n, params);
+            params += n;
+        }
+        if (*params == ';') {
+            len += snprintf(&out[len], size - len, ";");
+            params++;
+        }
+    }
+}
+
+/* Called whenever the theme, or what the terminal can show, changes */
+void theme_build()
+{
+    for (int i = 0; i < ATTR_COUNT; i++) {
+        char params[SGR_PARAMS];
+        if (ec.term & TERM_TRUECOLOR)
+            strcpy(params, theme.params[i]);
+        else
+            sgr_downgrade(theme.params[i], params, sizeof(params));
+        theme.sgr[i].len =
+            params[0] ? snprintf(theme.sgr[i].seq, sizeof(theme.sgr[i].seq),
+                                 "\x1b[0;%sm", params)
+                      : snprintf(theme.sgr[i].seq, sizeof(theme.sgr[i].seq),
+                                 "\x1b[m");
+    }
+}
+
+/* Turn a color of a theme file into SGR parameters: a name from the 16-color
+ * palette, an index into the 256-color one, #rrggbb or "default".
+ */
+int theme_color(const char *spec, bool bg, char *out, size_t size)
+{
+    static const char *names[] = {"black", "red",     "green", "yellow",
+                                  "blue",  "magenta", "cyan",  "white"};
+    unsigned r, g, b, index;
+    char end;
+    if (!strcmp(spec, "default"))
+        return snprintf(out, size, "%d", bg ? 49 : 39);
+    for (int i = 0; i < 8; i++) {
+        if (!strcmp(spec, names[i]))
+            return snprintf(out, size, "%d", (bg ? 40 : 30) + i);
+        if (!strncmp(spec, "bright", 6) && !strcmp(spec + 6, names[i]))
+            return snprintf(out, size, "%d", (bg ? 100 : 90) + i);
+    }
+    if (sscanf(spec, "#%2x%2x%2x%c", &r, &g, &b, &end) == 3 &&
+        (strlen(spec) == 7))
+        return snprintf(out, size, "%d;2;%u;%u;%u", bg ? 48 : 38, r, g, b);
+    if ((sscanf(spec, "%u%c", &index, &end) == 1) && (index < 256))
+        return snprintf(out, size, "%d;5;%u", bg ? 48 : 38, index);
+    return -1;
+}
+
+/* Each line of a theme file is an attribute name, a foreground color, and
+ * optionally a background color and bold, underline or reverse.  Attributes
+ * that are not listed keep their default look.
+ */
+int theme_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char *save, *name = strtok_r(line, " \t\r\n", &save);
+        if (!name || (name[0] == '#'))
+            continue;
+        int attr;
+        for (attr = 0; attr < ATTR_COUNT; attr++) {
+            if (!strcmp(name, attr_names[attr]))
+                break;
+        }
+        char params[SGR_PARAMS] = "";
+        int len = 0, colors = 0;
+        bool valid = (attr < ATTR_COUNT);
+        for (char *word; valid && (word = strtok_r(NULL, " \t\r\n", &save));) {
+            char param[24];
+            if (!strcmp(word, "bold"))
+                strcpy(param, "1");
+            else if (!strcmp(word, "underline"))
+                strcpy(param, "4");
+            else if (!strcmp(word, "reverse"))
+                strcpy(param, "7");
+            else if ((colors == 2) ||
+                     (theme_color(word, colors++, param, sizeof(param)) == -1))
+                valid = false;
+            if (!valid)
+                break; /* param was not set */
+            len += snprintf(&params[len], sizeof(params) - len, "%s%s",
+                            len ? ";" : "", param);
+            if (len >= (int) sizeof(params))
+                valid = false;
+        }
+        if (!valid || !colors) {
+            fprintf(stderr, "%s:%d: invalid theme entry\n", path, line_no);
+            fclose(fp);
+            return -1;
+        }
+        strcpy(theme.params[attr], params);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Syntaxes are defined in the format of the files -y loads.  A "syntax"
+ * line names one and the files it is for (a leading '.' matches a suffix,
+ * anything else a part of the name), and the lines after it describe it:
+ *   numbers                     highlight numbers
+ *   keywords <word>...          '|' after a word marks keyword2, '#' before
+ *                               it keyword3
+ *   line <attr> <start>         the rest of the line, from start
+ *   span <attr> <open> <close> [escape <byte>] [multiline] [nested]
+ *   heredoc <attr> <open>       up to the line that is only the word after
+ *                               open
+ *   plain <text>                text that only looks like a delimiter
+ */
+const char builtin_syntax[] =
+    "syntax c .c .cc .cxx .cpp .h\n"
+    "numbers\n"
+    "line sl_comment //\n"
+    "span ml_comment /* */ multiline\n"
+    "span string \" \" escape \\\n"
+    "span string ' ' escape \\\n"
+    "keywords switch if while for break continue return else struct union\n"
+    "keywords typedef static enum class case volatile register sizeof goto\n"
+    "keywords const auto #if #endif #error #ifdef #ifndef #elif #define\n"
+    "keywords #undef #include\n"
+    "keywords int| long| double| float| char| unsigned| signed| void| bool|\n"
+
+    "syntax python .py\n"
+    "numbers\n"
+    "line sl_comment #\n"
+    "span string \"\"\" \"\"\" escape \\ multiline\n"
+    "span string ''' ''' escape \\ multiline\n"
+    "span string \" \" escape \\\n"
+    "span string ' ' escape \\\n"
+    "keywords and as assert async await break class continue def del elif\n"
+    "keywords else except finally for from global if import in is lambda\n"
+    "keywords nonlocal not or pass raise return try while with yield\n"
+    "keywords False| None| True| bool| bytes| dict| float| int| list|\n"
+    "keywords object| self| set| str| tuple|\n"
+
+    "syntax go .go\n"
+    "numbers\n"
+    "line sl_comment //\n"
+    "span ml_comment /* */ multiline\n"
+    "span string \" \" escape \\\n"
+    "span string ' ' escape \\\n"
+    "span string ` ` multiline\n"
+    "keywords break case chan const continue default defer else fallthrough\n"
+    "keywords for func go goto if import interface map package range return\n"
+    "keywords select struct switch type var\n"
+    "keywords bool| byte| complex64| complex128| error| float32| float64|\n"
+    "keywords int| int8| int16| int32| int64| rune| string| uint| uint8|\n"
+    "keywords uint16| uint32| uint64| uintptr| true| false| nil| iota|\n"
+
+    "syntax rust .rs\n"
+    "numbers\n"
+    "line sl_comment //\n"
+    "span ml_comment /* */ multiline nested\n"
+    "span string \" \" escape \\ multiline\n"
+    "span string r\" \" multiline\n"
+    "span string r#\" \"# multiline\n"
+    "span string r##\" \"## multiline\n"
+    "keywords as async await break const continue crate dyn else enum extern\n"
+    "keywords fn for if impl in let loop match mod move mut pub ref return\n"
+    "keywords self Self static struct super trait type unsafe use where while\n"
+    "keywords bool| char| f32| f64| i8| i16| i32| i64| i128| isize| str| u8|\n"
+    "keywords u16| u32| u64| u128| usize| String| Vec| Option| Result| Some|\n"
+    "keywords None| Ok| Err| true| false|\n"
+
+    "syntax shell .sh .bash .zsh\n"
+    "numbers\n"
+    "line sl_comment #\n"
+    "plain $#\n"
+    "span normal ${ }\n"
+    "span string \" \" escape \\ multiline\n"
+    "span string ' ' multiline\n"
+    "heredoc string <<\n"
+    "plain <<<\n"
+    "keywords if then else elif fi case esac for select while until do done\n"
+    "keywords in function time return break continue local export readonly\n"
+    "keywords declare unset shift exit source eval exec trap set\n"
+
+    "syntax yaml .yaml .yml\n"
+    "numbers\n"
+    "line sl_comment #\n"
+    "span string \" \" escape \\\n"
+    "span string ' '\n"
+    "keywords true| false| null| yes| no| on| off| True| False| Null|\n"
+
+    "syntax json .json\n"
+    "numbers\n"
+    "span string \" \" escape \\\n"
+    "keywords true| false| null|\n"
+
+    "syntax make Makefile makefile GNUmakefile .mk\n"
+    "line sl_comment #\n"
+    "plain \\#\n"
+    "plain $$\n"
+    "span keyword2 $( ) nested\n"
+    "span keyword2 ${ } nested\n"
+    "keywords ifeq ifneq ifdef ifndef else endif include sinclude define\n"
+    "keywords endef export unexport override private vpath\n";
+
+/* Append to a NULL-terminated list */
+char **list_append(char **list, const char *word)
+{
+    int n = 0;
+    while (list && list[n])
+        n++;
+    list = realloc(list, (n + 2) * sizeof(*list));
+    list[n] = strdup(word);
+    list[n + 1] = NULL;
+    return list;
+}
+
+int attr_lookup(const char *name)
+{
+    for (int attr = NORMAL; attr <= NUMBER; attr++) {
+        if (!strcmp(name, attr_names[attr]))
+            return attr;
+    }
+    return -1;
+}
+
+bool lexer_rule_add(struct lexer *lx, const char *text, int action, int attr,
+                    int context, int target)
+{
+    if (!text || (strlen(text) > 255) || (lx->num_rules == LEX_RULES))
+        return false;
+    lx->rules[lx->num_rules++] = (struct lexer_rule){
+        strdup(text), strlen(text), action, attr, context, target};
+    return true;
+}
+
+/* Add a context for the text of a span */
+int lexer_context_add(struct lexer *lx, int attr, int flags)
+{
+    if (lx->num_contexts == LEX_CONTEXTS)
+        return -1;
+    lx->contexts[lx->num_contexts].attr = attr;
+    lx->contexts[lx->num_contexts].flags = flags;
+    return lx->num_contexts++;
+}
+
+/* Parse the span, heredoc, line and plain entries, the rest of whose line
+ * is left in strtok_r()'s save.
+ */
+bool lexer_entry(struct lexer *lx, const char *kind, char **save)
+{
+    const char *delims = " \t\r\n";
+    if (!strcmp(kind, "plain"))
+        return lexer_rule_add(lx, strtok_r(NULL, delims, save), LEX_PLAIN,
+                              NORMAL, 0, 0);
+    char *name = strtok_r(NULL, delims, save);
+    int attr = name ? attr_lookup(name) : -1;
+    char *open = strtok_r(NULL, delims, save);
+    if (attr == -1)
+        return false;
+    if (!strcmp(kind, "line"))
+        return lexer_rule_add(lx, open, LEX_LINE, attr, 0, 0);
+    if (!strcmp(kind, "heredoc")) {
+        int context =
+            lexer_context_add(lx, attr, SPAN_MULTILINE | SPAN_HEREDOC);
+        return (context != -1) &&
+               lexer_rule_add(lx, open, LEX_HEREDOC, attr, 0, context);
+    }
+    if (strcmp(kind, "span"))
+        return false;
+    char *close = strtok_r(NULL, delims, save);
+    int context = lexer_context_add(lx, attr, 0);
+    if ((context == -1) ||
+        !lexer_rule_add(lx, open, LEX_OPEN, attr, 0, context) ||
+        !lexer_rule_add(lx, close, LEX_CLOSE, attr, context, 0))
+        return false;
+    for (char *word; (word = strtok_r(NULL, delims, save));) {
+        if (!strcmp(word, "multiline"))
+            lx->contexts[context].flags |= SPAN_MULTILINE;
+        else if (!strcmp(word, "nested")) {
+            if (!lexer_rule_add(lx, open, LEX_NEST, attr, context, 0))
+                return false;
+        } else if (!strcmp(word, "escape")) {
+            char *escape = strtok_r(NULL, delims, save);
+            if (!escape || (strlen(escape) != 1) ||
+                !lexer_rule_add(lx, escape, LEX_ESCAPE, attr, context, 0))
+                return false;
+        } else
+            return false;
+    }
+    return true;
+}
+
+int syntax_parse(FILE *fp, const char *path)
+{
+    char line[256];
+    int line_no = 0;
+    editor_syntax *es = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char *save, *word = strtok_r(line, " \t\r\n", &save);
+        if (!word || (word[0] == '#'))
+            continue;
+        bool valid = true;
+        if (!strcmp(word, "syntax")) {
+            if (es)
+                syntax_compile(es);
+            char *name = strtok_r(NULL, " \t\r\n", &save);
+            syntaxes =
+                realloc(syntaxes, (num_syntaxes + 1) * sizeof(*syntaxes));
+            es = &syntaxes[num_syntaxes++];
+            *es = (editor_syntax){.file_type = name ? strdup(name) : NULL,
+                                  .keywords = calloc(1, sizeof(char *)),
+                                  .file_match = calloc(1, sizeof(char *))};
+            es->lexer = calloc(1, sizeof(*es->lexer));
+            es->lexer->num_contexts = 1; /* the code */
+            while ((word = strtok_r(NULL, " \t\r\n", &save)))
+                es->file_match = list_append(es->file_match, word);
+            valid = name && es->file_match[0];
+        } else if (!es)
+            valid = false;
+        else if (!strcmp(word, "numbers"))
+            es->flags |= HIGHLIGHT_NUMBERS;
+        else if (!strcmp(word, "keywords")) {
+            while ((word = strtok_r(NULL, " \t\r\n", &save)))
+                es->keywords = list_append(es->keywords, word);
+        } else
+            valid = lexer_entry(es->lexer, word, &save);
+        if (!valid) {
+            fprintf(stderr, "%s:%d: invalid syntax entry\n", path, line_no);
+            return -1;
+        }
+    }
+    if (es)
+        syntax_compile(es);
+    return 0;
+}
+
+int syntax_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    int ret = syntax_parse(fp, path);
+    fclose(fp);
+    return ret;
+}
+
+/* Lexer states mean nothing under another syntax */
+void highlight_reset()
+{
+    for (editor_row *row = row_at(0); row; row = row_next(row))
+        row->flags &= ~(ROW_HIGHLIGHT | ROW_LEXED);
+    highlight_invalidate(0, ec.num_rows);
 }
 
 void select_highlight()
 {
+    editor_syntax *syntax = ec.syntax;
     ec.syntax = NULL;
-    if (!ec.file_name)
+    if (!ec.file_name) {
+        if (syntax)
+            highlight_reset();
         return;
-    for (size_t j = 0; j < DB_ENTRIES; j++) {
-        editor_syntax *es = &DB[j];
+    }
+    for (int j = 0; j < num_syntaxes; j++) {
+        editor_syntax *es = &syntaxes[j];
         for (size_t i = 0; es->file_match[i]; i++) {
             char *p = strstr(ec.file_name, es->file_match[i]);
             if (!p)
@@ -397,120 +2107,230 @@ void select_highlight()
             int pat_len = strlen(es->file_match[i]);
             if ((es->file_match[i][0] != '.') || (p[pat_len] == '\0')) {
                 ec.syntax = es;
-                for (int file_row = 0; file_row < ec.num_rows; file_row++)
-                    highlight(&ec.row[file_row]);
+                if (es != syntax)
+                    highlight_reset();
                 return;
             }
         }
     }
+    if (syntax)
+        highlight_reset();
 }
 
 int row_cursorx_to_renderx(editor_row *row, int cursor_x)
 {
     int render_x = 0;
     for (int j = 0; j < cursor_x; j++) {
-        if (row->chars[j] == '\t')
+        if (row_char(row, j) == '\t')
             render_x += (TAB_STOP - 1) - (render_x % TAB_STOP);
         render_x++;
     }
     return render_x;
 }
 
-int row_renderx_to_cursorx(editor_row *row, int render_x)
+/* A row without tabs renders to its own text, so render just aliases chars
+ * and only the highlight bytes get a block.  Otherwise render and highlight
+ * share one block: the expanded text, its NUL, then one highlight byte per
+ * rendered column.  Aliased render is not NUL-terminated.
+ */
+static inline size_t render_block_size(editor_row *row)
 {
-    int cur_render_x = 0;
-    int cursor_x;
-    for (cursor_x = 0; cursor_x < row->size; cursor_x++) {
-        if (row->chars[cursor_x] == '\t')
-            cur_render_x += (TAB_STOP - 1) - (cur_render_x % TAB_STOP);
-        cur_render_x++;
-        if (cur_render_x > render_x)
-            return cursor_x;
-    }
-    return cursor_x;
+    return (row->flags & ROW_SHARED) ? row->render_size
+                                     : 2 * row->render_size + 1;
 }
 
-void update_row(editor_row *row)
+void render_free(editor_row *row)
 {
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t')
-            tabs++;
+    if (!row->render)
+        return;
+    if (row->flags & ROW_SHARED)
+        slab_free(row->highlight, render_block_size(row));
+    else
+        slab_free(row->render, render_block_size(row));
+    row->render = NULL;
+    row->highlight = NULL;
+}
+
+void render_row(editor_row *row)
+{
+    /* Only a row whose gap is already closed can be aliased; closing it here
+     * would cost two moves of the tail on every key typed mid-line.
+     */
+    char *tail = row_tail(row);
+    int tail_len = row->size - row->gap;
+    bool tabs = (row->gap && memchr(row->chars, '\t', row->gap)) ||
+                (tail_len && memchr(tail, '\t', tail_len));
+    bool shared = !tabs && !tail_len;
+    int render_size = tabs ? row_cursorx_to_renderx(row, row->size) : row->size;
+    if ((render_size != row->render_size) ||
+        (shared != !!(row->flags & ROW_SHARED)))
+        render_free(row);
+    row->render_size = render_size;
+    if (shared) {
+        row->flags |= ROW_SHARED;
+        if (!row->render)
+            row->highlight = slab_alloc(render_block_size(row));
+        row->render = row->chars;
+        row->flags = (row->flags | ROW_RENDER) & ~ROW_HIGHLIGHT;
+        return;
+    }
+    row->flags &= ~ROW_SHARED;
+    if (!row->render) {
+        row->render = slab_alloc(render_block_size(row));
+        row->highlight = (unsigned char *) &row->render[render_size + 1];
+    }
+    if (!tabs) {
+        memcpy(row->render, row->chars, row->gap);
+        memcpy(&row->render[row->gap], tail, tail_len);
+        row->render[render_size] = '\0';
+        row->flags = (row->flags | ROW_RENDER) & ~ROW_HIGHLIGHT;
+        return;
     }
-    free(row->render);
-    row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
     int idx = 0;
     for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
+        char c = row_char(row, j);
+        if (c == '\t') {
             row->render[idx++] = ' ';
             while (idx % TAB_STOP != 0)
                 row->render[idx++] = ' ';
         } else
-            row->render[idx++] = row->chars[j];
+            row->render[idx++] = c;
     }
     row->render[idx] = '\0';
-    row->render_size = idx;
-    highlight(row);
+    row->flags = (row->flags | ROW_RENDER) & ~ROW_HIGHLIGHT;
+}
+
+/* Called whenever the text of a row changes */
+void update_row(editor_row *row)
+{
+    row->flags &= ~(ROW_RENDER | ROW_HIGHLIGHT | ROW_LEXED);
+    int at = row_index(row);
+    highlight_invalidate(at, at + 1);
+}
+
+void materialize_row(editor_row *row, int at)
+{
+    if (!(row->flags & ROW_RENDER))
+        render_row(row);
+    if (!(row->flags & ROW_LEXED))
+        highlight_view(at, at);
+    if (!(row->flags & ROW_HIGHLIGHT))
+        highlight(row, row->hl_start);
 }
 
 void insert_row(int at, char *s, size_t line_len)
 {
     if ((at < 0) || (at > ec.num_rows))
         return;
-    ec.row = realloc(ec.row, sizeof(editor_row) * (ec.num_rows + 1));
-    memmove(&ec.row[at + 1], &ec.row[at],
-            sizeof(editor_row) * (ec.num_rows - at));
-    for (int j = at + 1; j <= ec.num_rows; j++)
-        ec.row[j].idx++;
-    ec.row[at].idx = at;
-    ec.row[at].size = line_len;
-    ec.row[at].chars = malloc(line_len + 1);
-    memcpy(ec.row[at].chars, s, line_len);
-    ec.row[at].chars[line_len] = '\0';
-    ec.row[at].render_size = 0;
-    ec.row[at].render = NULL;
-    ec.row[at].highlight = NULL;
-    ec.row[at].hl_open_comment = 0;
-    update_row(&ec.row[at]);
+    editor_row *row = row_alloc();
+    row->size = line_len;
+    row->capacity = slab_usable(line_len + 1);
+    row->gap = line_len;
+    row->chars = slab_alloc(row->capacity);
+    memcpy(row->chars, s, line_len);
+    row->count = 1;
+    row->priority = rand();
+    editor_row *l, *r;
+    row_split(ec.rows, at, &l, &r);
+    ec.rows = row_merge(row_merge(l, row), r);
+    ec.rows->parent = NULL;
     ec.num_rows++;
+    highlight_shift(at, 1);
     ec.modified++;
 }
 
 void free_row(editor_row *row)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
+    render_free(row);
+    if (row_pinned(row))
+        slab_free_deferred(row->chars, row->capacity);
+    else if (row->capacity)
+        slab_free(row->chars, row->capacity);
+}
+
+/* Once more than half of the slab memory sits on free lists, move every live
+ * block into fresh slabs and give the old ones back.
+ */
+void slab_compact()
+{
+    if (saving || (slab.free_bytes < 4 * SLAB_SIZE) ||
+        (slab.free_bytes < slab.slab_bytes / 2))
+        return;
+    void *old_slabs = slab.slabs;
+    large_block *large = slab.large.next;
+    size_t large_bytes = slab.large_bytes;
+    slab = (struct slab_arena){.large = {&slab.large, &slab.large}};
+    if (large != &slab.large) {
+        /* large blocks stay where they are */
+        large_block *last = large;
+        while (last->next != &slab.large)
+            last = last->next;
+        slab.large.next = large;
+        large->prev = &slab.large;
+        slab.large.prev = last;
+        slab.large_bytes = large_bytes;
+    }
+    for (editor_row *row = row_at(0); row; row = row_next(row)) {
+        if (row->capacity && (row->capacity <= SLAB_MAX_BLOCK)) {
+            char *chars = slab_alloc(row->capacity);
+            memcpy(chars, row->chars, row->capacity);
+            row->chars = chars;
+        }
+        if (!row->render)
+            continue;
+        size_t render_block = render_block_size(row);
+        if (row->flags & ROW_SHARED) {
+            row->render = row->chars;
+            if (render_block <= SLAB_MAX_BLOCK)
+                row->highlight = memcpy(slab_alloc(render_block),
+                                        row->highlight, render_block);
+        } else if (render_block <= SLAB_MAX_BLOCK) {
+            char *render = slab_alloc(render_block);
+            memcpy(render, row->render, render_block);
+            row->render = render;
+            row->highlight = (unsigned char *) &render[row->render_size + 1];
+        }
+    }
+    while (old_slabs) {
+        void *next = *(void **) old_slabs;
+        free(old_slabs);
+        old_slabs = next;
+    }
 }
 
 void delete_row(int at)
 {
     if (at < 0 || at >= ec.num_rows)
         return;
-    free_row(&ec.row[at]);
-    memmove(&ec.row[at], &ec.row[at + 1],
-            sizeof(editor_row) * (ec.num_rows - at - 1));
-    for (int j = at; j < ec.num_rows - 1; j++)
-        ec.row[j].idx--;
+    editor_row *l, *m, *r;
+    row_split(ec.rows, at, &l, &r);
+    row_split(r, 1, &m, &r);
+    ec.rows = row_merge(l, r);
+    if (ec.rows)
+        ec.rows->parent = NULL;
+    free_row(m);
+    row_release(m);
     ec.num_rows--;
+    highlight_shift(at, -1);
     ec.modified++;
 }
 
 void row_append(editor_row *row, char *s, size_t len)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
+    row_reserve(row, row->size + len);
+    row_move_gap(row, row->size);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
     row->size += len;
-    row->chars[row->size] = '\0';
     update_row(row);
     ec.modified++;
 }
 
 void copy(int cut)
 {
-    ec.copied_char_buffer =
-        realloc(ec.copied_char_buffer, strlen(ec.row[ec.cursor_y].chars) + 1);
-    strcpy(ec.copied_char_buffer, ec.row[ec.cursor_y].chars);
+    editor_row *row = row_at(ec.cursor_y);
+    ec.copied_char_buffer = realloc(ec.copied_char_buffer, row->size + 1);
+    strcpy(ec.copied_char_buffer, row_text(row));
     set_status_message(cut ? "Text cut" : "Text copied");
 }
 
@@ -518,11 +2338,8 @@ void cut()
 {
     copy(-1);
     delete_row(ec.cursor_y);
-    if (ec.num_rows - ec.cursor_y > 0)
-        highlight(&ec.row[ec.cursor_y]);
-    if (ec.num_rows - ec.cursor_y > 1)
-        highlight(&ec.row[ec.cursor_y + 1]);
-    ec.cursor_x = ec.cursor_y == ec.num_rows ? 0 : ec.row[ec.cursor_y].size;
+    editor_row *row = row_at(ec.cursor_y);
+    ec.cursor_x = row ? row->size : 0;
 }
 
 void paste()
@@ -533,19 +2350,84 @@ void paste()
         insert_row(ec.cursor_y, ec.copied_char_buffer,
                    strlen(ec.copied_char_buffer));
     else
-        row_append(&ec.row[ec.cursor_y], ec.copied_char_buffer,
+        row_append(row_at(ec.cursor_y), ec.copied_char_buffer,
                    strlen(ec.copied_char_buffer));
     ec.cursor_x += strlen(ec.copied_char_buffer);
 }
 
+void row_insert_text(editor_row *row, int at, const char *s, size_t len)
+{
+    row_reserve(row, row->size + len);
+    row_move_gap(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->size += len;
+    update_row(row);
+    ec.modified++;
+}
+
+/* Insert text of any number of lines at the cursor in one go.  The lines
+ * after the first become rows built into a treap of their own, which is
+ * spliced in; like the rows of a file just opened, they are only rendered
+ * and highlighted once they come into view.
+ */
+void insert_text(const char *text, size_t len)
+{
+    if (!len)
+        return;
+    if (ec.cursor_y == ec.num_rows)
+        insert_row(ec.num_rows, "", 0);
+    editor_row *row = row_at(ec.cursor_y);
+    const char *eol = memchr(text, '\n', len);
+    if (!eol) {
+        row_insert_text(row, ec.cursor_x, text, len);
+        ec.cursor_x += len;
+        return;
+    }
+
+    /* the tail of the cursor row moves to the end of the last line */
+    row_move_gap(row, ec.cursor_x);
+    int tail_len = row->size - ec.cursor_x;
+    size_t n = count_lines(text, len);
+    editor_row *rows = row_pool_block(n);
+    const char *p = eol + 1, *end = text + len;
+    int last_len = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *next = (i + 1 < n) ? memchr(p, '\n', end - p) : end;
+        int line_len = next - p, size = line_len;
+        if (i + 1 == n)
+            size += tail_len;
+        rows[i].capacity = slab_usable(size + 1);
+        rows[i].chars = slab_alloc(rows[i].capacity);
+        memcpy(rows[i].chars, p, line_len);
+        if (i + 1 == n) {
+            memcpy(&rows[i].chars[line_len], row_tail(row), tail_len);
+            last_len = line_len;
+        }
+        rows[i].size = rows[i].gap = size;
+        p = next + 1;
+    }
+    row->size = ec.cursor_x; /* the gap swallows the moved tail */
+    row_insert_text(row, ec.cursor_x, text, eol - text);
+
+    editor_row *l, *r;
+    row_split(ec.rows, ec.cursor_y + 1, &l, &r);
+    ec.rows = row_merge(row_merge(l, row_build(rows, n)), r);
+    ec.rows->parent = NULL;
+    ec.num_rows += n;
+    highlight_shift(ec.cursor_y + 1, n);
+    ec.cursor_y += n;
+    ec.cursor_x = last_len;
+}
+
 void row_insert_char(editor_row *row, int at, int c)
 {
     if ((at < 0) || (at > row->size))
         at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row_reserve(row, row->size + 1);
+    row_move_gap(row, at);
+    row->chars[row->gap++] = c;
     row->size++;
-    row->chars[at] = c;
     update_row(row);
     ec.modified++;
 }
@@ -555,12 +2437,10 @@ void newline()
     if (ec.cursor_x == 0)
         insert_row(ec.cursor_y, "", 0);
     else {
-        editor_row *row = &ec.row[ec.cursor_y];
-        insert_row(ec.cursor_y + 1, &row->chars[ec.cursor_x],
-                   row->size - ec.cursor_x);
-        row = &ec.row[ec.cursor_y];
-        row->size = ec.cursor_x;
-        row->chars[row->size] = '\0';
+        editor_row *row = row_at(ec.cursor_y);
+        row_move_gap(row, ec.cursor_x);
+        insert_row(ec.cursor_y + 1, row_tail(row), row->size - ec.cursor_x);
+        row->size = ec.cursor_x; /* the gap swallows the moved tail */
         update_row(row);
     }
     ec.cursor_y++;
@@ -571,7 +2451,10 @@ void row_delete_char(editor_row *row, int at)
 {
     if ((at < 0) || (at >= row->size))
         return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row_move_gap(row, at + 1);
+    if (row_pinned(row))
+        row_unpin(row); /* what is typed next would land in the snapshot */
+    row->gap--;
     row->size--;
     update_row(row);
     ec.modified++;
@@ -581,7 +2464,7 @@ void insert_char(int c)
 {
     if (ec.cursor_y == ec.num_rows)
         insert_row(ec.num_rows, "", 0);
-    row_insert_char(&ec.row[ec.cursor_y], ec.cursor_x, c);
+    row_insert_char(row_at(ec.cursor_y), ec.cursor_x, c);
     ec.cursor_x++;
 }
 
@@ -591,57 +2474,378 @@ void delete_char()
         return;
     if (ec.cursor_x == 0 && ec.cursor_y == 0)
         return;
-    editor_row *row = &ec.row[ec.cursor_y];
+    editor_row *row = row_at(ec.cursor_y);
     if (ec.cursor_x > 0) {
         row_delete_char(row, ec.cursor_x - 1);
         ec.cursor_x--;
     } else {
-        ec.cursor_x = ec.row[ec.cursor_y - 1].size;
-        row_append(&ec.row[ec.cursor_y - 1], row->chars, row->size);
+        editor_row *prev = row_prev(row);
+        ec.cursor_x = prev->size;
+        row_append(prev, row_text(row), row->size);
         delete_row(ec.cursor_y);
         ec.cursor_y--;
     }
 }
 
-char *rows_tostring(int *buf_len)
+/* Write out all of buf, picking up again after short writes */
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                poll(&(struct pollfd){fd, POLLOUT, 0}, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* Write out all of iov[0, n), picking up again after short writes */
+int writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n) {
+        ssize_t written = writev(fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; n && ((size_t) written >= iov->iov_len); iov++, n--)
+            written -= iov->iov_len;
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+#define SAVE_IOVECS 1024 /* IOV_MAX on Linux */
+
+/* A save runs on its own thread, from a snapshot of where the text of each
+ * row was when it started.  Until it is done, pinned rows are copied before
+ * their text is changed, and blocks it may read are not freed.
+ */
+struct save_job {
+    pthread_t thread;
+    char *path;
+    bool atomic;
+    mode_t umask;
+    struct iovec *lines;
+    int num_lines;
+    int modified; /* ec.modified when the snapshot was taken */
+    ssize_t len;
+    int error;
+    bool done;
+};
+
+/* Stream the snapshot to fd, with a newline after each iovec, and return
+ * the number of bytes written or -1.
+ */
+ssize_t write_lines(int fd, struct save_job *job)
+{
+    struct iovec iov[SAVE_IOVECS];
+    int n = 0;
+    size_t total = 0;
+    for (int i = 0; i < job->num_lines; i++) {
+        if (n > SAVE_IOVECS - 2) {
+            if (writev_all(fd, iov, n) == -1)
+                return -1;
+            n = 0;
+        }
+        iov[n++] = job->lines[i];
+        iov[n++] = (struct iovec){"\n", 1};
+        total += job->lines[i].iov_len + 1;
+    }
+    if (writev_all(fd, iov, n) == -1)
+        return -1;
+    return total;
+}
+
+size_t count_lines(const char *p, size_t len)
+{
+    size_t lines = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+#endif
+    for (; i < len; i++)
+        lines += (p[i] == '\n');
+    return lines;
+}
+
+/* Rows still borrowing their text from the mapping get their own copy, so
+ * that the file underneath can be rewritten.
+ */
+void detach_mapping()
+{
+    if (!ec.map)
+        return;
+    for (editor_row *row = row_at(0); row; row = row_next(row)) {
+        if (!row->capacity)
+            row_reserve(row, row->size);
+    }
+    munmap(ec.map, ec.map_size);
+    ec.map = NULL;
+    ec.map_size = 0;
+}
+
+/* Pages of the mapping past the end of a file that was truncated behind our
+ * back raise SIGBUS.  Each one is replaced with zeroes as it is touched, so
+ * that the access can complete, and the editing thread is told about it.
+ */
+void map_fault(int sig, siginfo_t *info, void *ucontext)
+{
+    char *addr = info->si_addr, *map = ec.map;
+    if (!map || (addr < map) || (addr >= map + ec.map_size)) {
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    mmap((void *) ((uintptr_t) addr & ~(page - 1)), page, PROT_READ,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    __atomic_store_n(&ec.map_lost, true, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    write(ec.wake_fd, &one, sizeof(one));
+}
+
+void map_poll()
+{
+    if (!__atomic_exchange_n(&ec.map_lost, false, __ATOMIC_RELAXED))
+        return;
+    ec.modified++;
+    set_status_message("%s was truncated on disk, part of it is lost",
+                       ec.file_name);
+}
+
+/* Pipes and other files that cannot be mapped are read into an anonymous
+ * mapping instead, which then stands in for the file.
+ */
+char *read_stream(int fd, size_t *len, size_t *size)
 {
-    int total_len = 0;
-    for (int j = 0; j < ec.num_rows; j++)
-        total_len += ec.row[j].size + 1;
-    *buf_len = total_len;
-    char *buf = malloc(total_len);
-    char *p = buf;
-    for (int j = 0; j < ec.num_rows; j++) {
-        memcpy(p, ec.row[j].chars, ec.row[j].size);
-        p += ec.row[j].size;
-        *p = '\n';
-        p++;
+    *size = 1 << 20;
+    *len = 0;
+    char *buf = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    while (buf != MAP_FAILED) {
+        if (*len == *size) {
+            char *grown = mremap(buf, *size, *size * 2, MREMAP_MAYMOVE);
+            if (grown == MAP_FAILED) {
+                munmap(buf, *size);
+                return MAP_FAILED;
+            }
+            buf = grown;
+            *size *= 2;
+        }
+        ssize_t n = read(fd, buf + *len, *size - *len);
+        if (n > 0)
+            *len += n;
+        else if (!n)
+            break;
+        else if (errno != EINTR) {
+            munmap(buf, *size);
+            return MAP_FAILED;
+        }
     }
     return buf;
 }
 
+/* Everything a buffer owns is released in bulk, without visiting its rows */
+void close_file()
+{
+    save_wait();
+    slab_reset();
+    row_pool_reset();
+    ec.rows = NULL;
+    ec.num_rows = 0;
+    ec.hl_frontier = ec.hl_dirty = 0;
+    ec.cursor_x = ec.cursor_y = ec.row_offset = ec.col_offset = 0;
+    if (ec.map)
+        munmap(ec.map, ec.map_size);
+    ec.map = NULL;
+    ec.map_size = 0;
+    ec.modified = 0;
+}
+
 void open_file(char *file_name)
 {
+    close_file();
     free(ec.file_name);
     ec.file_name = strdup(file_name);
     select_highlight();
-    FILE *file = fopen(file_name, "r+");
-    if (!file)
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if ((fd == -1) || (fstat(fd, &st) == -1))
         panic("Failed to open the file");
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len;
-    while ((line_len = getline(&line, &line_cap, file)) != -1) {
+    size_t len = S_ISREG(st.st_mode) ? st.st_size : 0, map_size = len;
+    char *map = NULL;
+    if (len) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+            madvise(map, len, MADV_SEQUENTIAL);
+    }
+    if (!S_ISREG(st.st_mode) || (map == MAP_FAILED)) {
+        map = read_stream(fd, &len, &map_size);
+        if (map == MAP_FAILED)
+            panic("Failed to read the file");
+    }
+    close(fd);
+
+    /* Rows are created in one block and borrow their text from the mapping;
+     * nothing is copied until a line is edited.
+     */
+    char *end = map + len;
+    size_t n = count_lines(map, len);
+    if (len && end[-1] != '\n')
+        n++;
+    editor_row *rows = n ? row_pool_block(n) : NULL;
+    char *p = map;
+    for (size_t i = 0; i < n; i++) {
+        char *eol = memchr(p, '\n', end - p);
+        char *next = eol ? eol + 1 : end;
+        size_t line_len = next - p;
         if (line_len > 0 &&
-            (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+            (p[line_len - 1] == '\n' || p[line_len - 1] == '\r'))
             line_len--;
-        insert_row(ec.num_rows, line, line_len);
+        rows[i].chars = p;
+        rows[i].size = rows[i].gap = line_len;
+        p = next;
     }
-    free(line);
-    fclose(file);
+    ec.map = map;
+    ec.map_size = map_size;
+    ec.rows = row_merge(ec.rows, row_build(rows, n));
+    highlight_shift(ec.num_rows, n);
+    ec.num_rows += n;
     ec.modified = 0;
 }
 
+int sync_dir(const char *path)
+{
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd == -1)
+        return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/* Replacing the file by rename() needs a writable directory, and would
+ * change the owner of someone else's file or split a hard link.
+ */
+bool can_replace(const char *path)
+{
+    char *copy = strdup(path);
+    bool dir_writable = !access(dirname(copy), W_OK);
+    free(copy);
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return dir_writable;
+    return dir_writable && (st.st_nlink == 1) &&
+           ((st.st_uid == geteuid()) || (geteuid() == 0));
+}
+
+/* Write the rows to a sibling temporary file and rename it over the target,
+ * so that a crash or a full disk leaves either the old file or the new one.
+ */
+ssize_t save_atomic(struct save_job *job)
+{
+    const char *path = job->path;
+    struct stat st;
+    bool exists = !stat(path, &st);
+    char *tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+    /* the group is kept where we are allowed to */
+    if (exists)
+        fchown(fd, st.st_uid, st.st_gid);
+    ssize_t len = -1;
+    mode_t mode = exists ? (st.st_mode & 07777) : (0644 & ~job->umask);
+    if ((fchmod(fd, mode) == -1) ||
+        ((len = write_lines(fd, job)) == -1) ||
+        ((ec.save_sync != SYNC_NONE) && (fsync(fd) == -1)))
+        len = -1;
+    int saved_errno = errno;
+    if ((close(fd) == -1) || ((len != -1) && (rename(tmp, path) == -1))) {
+        saved_errno = errno;
+        len = -1;
+    }
+    if (len == -1)
+        unlink(tmp);
+    else if ((ec.save_sync == SYNC_FULL) && (sync_dir(path) == -1)) {
+        saved_errno = errno;
+        len = -1;
+    }
+    free(tmp);
+    errno = saved_errno;
+    return len;
+}
+
+/* Rewrite the file where it is, when it cannot be replaced */
+ssize_t save_in_place(struct save_job *job)
+{
+    int fd = open(job->path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return -1;
+    ssize_t len = write_lines(fd, job);
+    if ((len == -1) || (ftruncate(fd, len) == -1) ||
+        ((ec.save_sync != SYNC_NONE) && (fsync(fd) == -1))) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+    return len;
+}
+
+void *save_thread(void *arg)
+{
+    struct save_job *job = arg;
+    job->len = job->atomic ? save_atomic(job) : save_in_place(job);
+    job->error = errno;
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    write(ec.wake_fd, &one, sizeof(one));
+    return NULL;
+}
+
+void save_finish()
+{
+    struct save_job *job = saving;
+    saving = NULL;
+    slab_release_deferred();
+    if (job->len == -1)
+        set_status_message("Error: %s", strerror(job->error));
+    else {
+        /* edits made while saving keep the buffer modified */
+        if (ec.modified == job->modified)
+            ec.modified = 0;
+        if (job->len > 1000)
+            set_status_message("%zd KB written to disk", job->len / 1000);
+        else
+            set_status_message("%zd B written to disk", job->len);
+    }
+    free(job->lines);
+    free(job->path);
+    free(job);
+}
+
 void save_file()
 {
     if (!ec.file_name) {
@@ -652,24 +2856,78 @@ void save_file()
         }
         select_highlight();
     }
-    int len;
-    char *buf = rows_tostring(&len);
-    int fd = open(ec.file_name, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if ((ftruncate(fd, len) != -1) && (write(fd, buf, len) == len)) {
-            close(fd);
-            free(buf);
-            ec.modified = 0;
-            if (len > 1000)
-                set_status_message("%d KB written to disk", len / 1000);
-            else
-                set_status_message("%d B written to disk", len);
-            return;
+    if (saving) {
+        set_status_message("A save is already in progress");
+        return;
+    }
+    struct save_job *job = calloc(1, sizeof(*job));
+    /* replace the file a symlink points to, not the link */
+    job->path = realpath(ec.file_name, NULL);
+    if (!job->path)
+        job->path = strdup(ec.file_name);
+    job->atomic = can_replace(job->path);
+    job->umask = umask(0);
+    umask(job->umask);
+    if (!job->atomic)
+        detach_mapping();
+
+    /* The snapshot is one iovec per line, each row's text made contiguous
+     * and pinned so that the writer never sees it move.  A run of rows that
+     * still borrow consecutive lines of the mapping takes a single iovec,
+     * newlines included, so that saving a file with few edits costs little
+     * more than the walk over its rows.
+     */
+    int capacity = 1024;
+    job->lines = malloc(capacity * sizeof(*job->lines));
+    struct iovec *run = NULL;
+    for (editor_row *row = row_at(0); row; row = row_next(row)) {
+        if (!row->capacity && run &&
+            (row->chars == (char *) run->iov_base + run->iov_len + 1) &&
+            (row->chars[-1] == '\n')) {
+            run->iov_len += row->size + 1;
+            row->flags &= ~ROW_PINNED;
+            continue;
         }
-        close(fd);
+        if (job->num_lines == capacity) {
+            capacity *= 2;
+            job->lines = realloc(job->lines, capacity * sizeof(*job->lines));
+        }
+        run = &job->lines[job->num_lines++];
+        *run = (struct iovec){row_contiguous(row), row->size};
+        if (row->capacity) {
+            row->flags |= ROW_PINNED;
+            run = NULL;
+        } else
+            row->flags &= ~ROW_PINNED;
+    }
+    job->modified = ec.modified;
+    saving = job;
+    int err = pthread_create(&job->thread, NULL, save_thread, job);
+    if (err) {
+        job->len = -1;
+        job->error = err;
+        save_finish();
+        return;
+    }
+    set_status_message("Saving %s...", ec.file_name);
+}
+
+/* Report a finished save, if there is one, from the editing thread */
+void save_poll()
+{
+    if (saving && __atomic_load_n(&saving->done, __ATOMIC_ACQUIRE)) {
+        pthread_join(saving->thread, NULL);
+        save_finish();
+    }
+}
+
+/* Block until the save in flight, if any, is finished */
+void save_wait()
+{
+    if (saving) {
+        pthread_join(saving->thread, NULL);
+        save_finish();
     }
-    free(buf);
-    set_status_message("Error: %s", strerror(errno));
 }
 
 void search_cb(char *query, int key)
@@ -679,8 +2937,8 @@ void search_cb(char *query, int key)
     static int saved_highlight_line;
     static char *saved_hightlight = NULL;
     if (saved_hightlight) {
-        memcpy(ec.row[saved_highlight_line].highlight, saved_hightlight,
-               ec.row[saved_highlight_line].render_size);
+        editor_row *row = row_at(saved_highlight_line);
+        memcpy(row->highlight, saved_hightlight, row->render_size);
         free(saved_hightlight);
         saved_hightlight = NULL;
     }
@@ -699,23 +2957,33 @@ void search_cb(char *query, int key)
         direction = 1;
     }
     int current = last_match;
+    editor_row *row = row_at(current);
     for (int i = 0; i < ec.num_rows; i++) {
         current += direction;
-        if (current == -1)
+        if (row)
+            row = (direction == 1) ? row_next(row) : row_prev(row);
+        if (current == -1) {
             current = ec.num_rows - 1;
-        else if (current == ec.num_rows)
+            row = row_at(current);
+        } else if (current == ec.num_rows) {
             current = 0;
-        editor_row *row = &ec.row[current];
-        char *match = strstr(row->render, query);
+            row = row_at(current);
+        } else if (!row)
+            row = row_at(current);
+        /* match against the raw text, so rows off screen stay unrendered */
+        char *text = row_contiguous(row);
+        char *match = memmem(text, row->size, query, strlen(query));
         if (match) {
             last_match = current;
             ec.cursor_y = current;
-            ec.cursor_x = row_renderx_to_cursorx(row, match - row->render);
+            ec.cursor_x = match - text;
             ec.row_offset = ec.num_rows;
+            materialize_row(row, current);
             saved_highlight_line = current;
             saved_hightlight = malloc(row->render_size);
             memcpy(saved_hightlight, row->highlight, row->render_size);
-            memset(&row->highlight[match - row->render], MATCH, strlen(query));
+            memset(&row->highlight[row_cursorx_to_renderx(row, ec.cursor_x)],
+                   MATCH, strlen(query));
             break;
         }
     }
@@ -738,26 +3006,57 @@ void search()
     }
 }
 
-void buf_append(editor_buf *eb, const char *s, int len)
+bool buf_grow(editor_buf *eb, int len)
 {
-    char *new = realloc(eb->buf, eb->len + len);
+    int capacity = eb->capacity ? eb->capacity : 4096;
+    while (capacity < eb->len + len)
+        capacity *= 2;
+    char *new = realloc(eb->buf, capacity);
     if (!new)
-        return;
-    memcpy(&new[eb->len], s, len);
+        return false;
     eb->buf = new;
+    eb->capacity = capacity;
+    return true;
+}
+
+static inline void buf_append(editor_buf *eb, const char *s, int len)
+{
+    if ((eb->len + len > eb->capacity) && !buf_grow(eb, len))
+        return;
+    memcpy(&eb->buf[eb->len], s, len);
     eb->len += len;
 }
 
-void buf_free(editor_buf *eb)
+static inline void buf_putc(editor_buf *eb, char c)
+{
+    if ((eb->len == eb->capacity) && !buf_grow(eb, 1))
+        return;
+    eb->buf[eb->len++] = c;
+}
+
+/* For escape sequences known at compile time: no strlen() at run time */
+#define buf_append_str(eb, s) buf_append(eb, s, sizeof(s) - 1)
+
+/* Append a cursor jump to the 0-based line y and column x */
+void buf_append_goto(editor_buf *eb, int y, int x)
 {
-    free(eb->buf);
+    char buf[32], *p = &buf[sizeof(buf)];
+    *--p = 'H';
+    for (x++; x; x /= 10)
+        *--p = '0' + x % 10;
+    *--p = ';';
+    for (y++; y; y /= 10)
+        *--p = '0' + y % 10;
+    *--p = '[';
+    *--p = '\x1b';
+    buf_append(eb, p, &buf[sizeof(buf)] - p);
 }
 
 void scroll()
 {
     ec.render_x = 0;
     if (ec.cursor_y < ec.num_rows)
-        ec.render_x = row_cursorx_to_renderx(&ec.row[ec.cursor_y], ec.cursor_x);
+        ec.render_x = row_cursorx_to_renderx(row_at(ec.cursor_y), ec.cursor_x);
     if (ec.cursor_y < ec.row_offset)
         ec.row_offset = ec.cursor_y;
     if (ec.cursor_y >= ec.row_offset + ec.screen_rows)
@@ -768,49 +3067,113 @@ void scroll()
         ec.col_offset = ec.render_x - ec.screen_cols + 1;
 }
 
-void draw_statusbar(editor_buf *eb)
+void show_memory_usage()
+{
+    set_status_message(
+        "%d lines: slabs %zu KB (%zu KB free), large %zu KB, nodes %zu KB",
+        ec.num_rows, slab.slab_bytes / 1024, slab.free_bytes / 1024,
+        slab.large_bytes / 1024, row_pool.bytes / 1024);
+}
+
+/* The renderer composes each frame into a grid of cells and sends only what
+ * differs from the previous frame, which the grid remembers.
+ */
+typedef struct {
+    char c;
+    unsigned char attr;
+} screen_cell;
+
+struct {
+    screen_cell *prev, *next;
+    int rows, cols;
+    int row_offset, col_offset; /* of the text shown in prev */
+    int cursor_y, cursor_x;
+    volatile sig_atomic_t stale; /* the terminal no longer shows prev */
+} screen = {NULL, NULL, 0, 0, 0, 0, 0, 0, 1};
+
+/* The renderer never reads the rows, which the editing thread changes and
+ * frees at will.  Instead the editing thread publishes a view: a copy of the
+ * text on screen and of what the status bars show.  Of three views, one is
+ * being filled by the editing thread, one is drawn by the renderer, and one
+ * is the latest complete view between them.  The two sides trade views by
+ * exchanging indices, so neither ever waits for the other, and a view is
+ * only drawn once it is complete.
+ */
+typedef struct {
+    screen_cell *text; /* rows * cols cells */
+    int rows, cols, capacity;
+    int row_offset, col_offset;
+    int cursor_y, cursor_x; /* on the screen */
+    int line, num_rows, col, col_size;
+    bool modified;
+    char file_name[21];
+    char status_msg[80];
+} editor_view;
+
+#define VIEW_FRESH 4 /* set on the middle index until the renderer takes it */
+
+struct {
+    editor_view views[3];
+    int back, front; /* owned by the editing thread and renderer */
+    int middle;
+} view = {.back = 0, .front = 1, .middle = 2};
+
+/* Changes closer together than this are sent as one run, as the text in
+ * between is cheaper than a cursor jump.
+ */
+#define SCREEN_GAP 6
+
+static inline bool cell_equal(screen_cell a, screen_cell b)
+{
+    return (a.c == b.c) && (a.attr == b.attr);
+}
+
+void screen_resize(int rows, int cols)
+{
+    if ((rows == screen.rows) && (cols == screen.cols))
+        return;
+    screen.rows = rows;
+    screen.cols = cols;
+    screen.prev = realloc(screen.prev, rows * cols * sizeof(screen_cell));
+    screen.next = realloc(screen.next, rows * cols * sizeof(screen_cell));
+    screen.stale = 1;
+}
+
+void screen_puts(screen_cell *line, int x, const char *s, int len, int attr)
+{
+    for (int i = 0; (i < len) && (x + i < screen.cols); i++)
+        line[x + i] = (screen_cell){s[i], attr};
+}
+
+void draw_statusbar(screen_cell *line, editor_view *v)
 {
     time_t now = time(NULL);
     struct tm *currtime;
-    buf_append(eb, "\x1b[100m", 6); /* Dark gray */
     char status[80], r_status[80];
     currtime = localtime(&now);
-    int len = snprintf(status, sizeof(status), "  File: %.20s %s",
-                       ec.file_name ? ec.file_name : "< New >",
-                       ec.modified ? "(modified)" : "");
-    int col_size = ec.row &&ec.cursor_y <= ec.num_rows - 1
-                       ? col_size = ec.row[ec.cursor_y].size
-                       : 0;
-    int r_len = snprintf(
-        r_status, sizeof(r_status), "%d/%d lines  %d/%d cols [ %2d:%2d:%2d ]",
-        (ec.cursor_y + 1 > ec.num_rows) ? ec.num_rows : ec.cursor_y + 1,
-        ec.num_rows, (ec.cursor_x + 1 > col_size) ? col_size : ec.cursor_x + 1,
-        col_size, currtime->tm_hour, currtime->tm_min, currtime->tm_sec);
-    if (len > ec.screen_cols)
-        len = ec.screen_cols;
-    buf_append(eb, status, len);
-    while (len < ec.screen_cols) {
-        if (ec.screen_cols - len == r_len) {
-            buf_append(eb, r_status, r_len);
-            break;
-        }
-        buf_append(eb, " ", 1);
-        len++;
-    }
-    buf_append(eb, "\x1b[m", 3);
-    buf_append(eb, "\r\n", 2);
+    int len = snprintf(status, sizeof(status), "  File: %s %s", v->file_name,
+                       v->modified ? "(modified)" : "");
+    int r_len = snprintf(r_status, sizeof(r_status), "%d/%d lines  %d/%d cols",
+                         v->line, v->num_rows, v->col, v->col_size);
+    /* a ticking clock would cost a frame every second */
+    if (!ec.low_bandwidth)
+        r_len += snprintf(&r_status[r_len], sizeof(r_status) - r_len,
+                          " [ %2d:%2d:%2d ]", currtime->tm_hour,
+                          currtime->tm_min, currtime->tm_sec);
+    if (len > screen.cols)
+        len = screen.cols;
+    for (int x = 0; x < screen.cols; x++)
+        line[x] = (screen_cell){' ', ATTR_STATUS};
+    screen_puts(line, 0, status, len, ATTR_STATUS);
+    if (screen.cols - len >= r_len)
+        screen_puts(line, screen.cols - r_len, r_status, r_len, ATTR_STATUS);
 }
 
-void draw_messagebar(editor_buf *eb)
+void draw_messagebar(screen_cell *line, editor_view *v)
 {
-    buf_append(eb, "\x1b[93m\x1b[44m\x1b[K", 13);
-    int msg_len = strlen(ec.status_msg);
-    if (msg_len > ec.screen_cols)
-        msg_len = ec.screen_cols;
-    /* display for 5 seconds and then hide */
-    if (msg_len && time(NULL) - ec.status_msg_time < 5)
-        buf_append(eb, ec.status_msg, msg_len);
-    buf_append(eb, "\x1b[0m", 4);
+    for (int x = 0; x < screen.cols; x++)
+        line[x] = (screen_cell){' ', ATTR_MESSAGE};
+    screen_puts(line, 0, v->status_msg, strlen(v->status_msg), ATTR_MESSAGE);
 }
 
 void set_status_message(const char *msg, ...)
@@ -819,96 +3182,283 @@ void set_status_message(const char *msg, ...)
     va_start(args, msg);
     vsnprintf(ec.status_msg, sizeof(ec.status_msg), msg, args);
     va_end(args);
-    ec.status_msg_time = time(NULL);
+    /* display for 5 seconds and then hide */
+    struct itimerspec expiry = {{0, 0}, {5, 0}};
+    timerfd_settime(ec.message_timer, 0, &expiry, NULL);
+    publish_view();
 }
 
-void draw_rows(editor_buf *eb)
+void draw_rows(editor_view *v)
 {
-    for (int y = 0; y < ec.screen_rows; y++) {
-        int file_row = y + ec.row_offset;
-        if (file_row >= ec.num_rows) {
-            buf_append(eb, "~", 1);
+    highlight_view(v->row_offset, v->row_offset + v->rows - 1);
+    editor_row *row = row_at(v->row_offset);
+    for (int y = 0; y < v->rows; y++) {
+        screen_cell *line = &v->text[y * v->cols];
+        int x = 0;
+        if (!row) {
+            line[x++] = (screen_cell){'~', NORMAL};
         } else {
-            int len = ec.row[file_row].render_size - ec.col_offset;
+            materialize_row(row, v->row_offset + y);
+            int len = row->render_size - v->col_offset;
             if (len < 0)
                 len = 0;
-            if (len > ec.screen_cols)
-                len = ec.screen_cols;
-            char *c = &ec.row[file_row].render[ec.col_offset];
-            unsigned char *highlight =
-                &ec.row[file_row].highlight[ec.col_offset];
-            int current_color = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    buf_append(eb, "\x1b[7m", 4);
-                    buf_append(eb, &sym, 1);
-                    buf_append(eb, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int c_len = snprintf(buf, sizeof(buf), "\x1b[%dm",
-                                             current_color);
-                        buf_append(eb, buf, c_len);
-                    }
-                } else if (highlight[j] == NORMAL) {
-                    if (current_color != -1) {
-                        buf_append(eb, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    buf_append(eb, &c[j], 1);
-                } else {
-                    int color = token_to_color(highlight[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int c_len =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        buf_append(eb, buf, c_len);
-                    }
-                    buf_append(eb, &c[j], 1);
-                }
+            if (len > v->cols)
+                len = v->cols;
+            char *c = &row->render[v->col_offset];
+            unsigned char *highlight = &row->highlight[v->col_offset];
+            for (; x < len; x++) {
+                if (iscntrl(c[x]))
+                    line[x] = (screen_cell){(c[x] <= 26) ? '@' + c[x] : '?',
+                                            ATTR_CONTROL};
+                else
+                    line[x] = (screen_cell){c[x], highlight[x]};
             }
-            buf_append(eb, "\x1b[39m", 5);
+            row = row_next(row);
         }
-        buf_append(eb, "\x1b[K", 3);
-        buf_append(eb, "\r\n", 2);
+        for (; x < v->cols; x++)
+            line[x] = (screen_cell){' ', NORMAL};
     }
 }
 
-void refresh_screen()
+/* Fill the back view from the editor state and hand it to the renderer */
+void publish_view()
 {
+    editor_view *v = &view.views[view.back];
     scroll();
-    editor_buf eb = {NULL, 0};
-    buf_append(&eb, "\x1b[?25l", 6);
-    buf_append(&eb, "\x1b[H", 3);
-    draw_rows(&eb);
-    draw_statusbar(&eb);
-    draw_messagebar(&eb);
+    v->rows = ec.screen_rows;
+    v->cols = ec.screen_cols;
+    if (v->rows * v->cols > v->capacity) {
+        v->capacity = v->rows * v->cols;
+        v->text = realloc(v->text, v->capacity * sizeof(screen_cell));
+    }
+    v->row_offset = ec.row_offset;
+    v->col_offset = ec.col_offset;
+    v->cursor_y = ec.cursor_y - ec.row_offset;
+    v->cursor_x = ec.render_x - ec.col_offset;
+    draw_rows(v);
+
+    editor_row *row = row_at(ec.cursor_y);
+    v->col_size = row ? row->size : 0;
+    v->num_rows = ec.num_rows;
+    v->line = (ec.cursor_y + 1 > ec.num_rows) ? ec.num_rows : ec.cursor_y + 1;
+    v->col = (ec.cursor_x + 1 > v->col_size) ? v->col_size : ec.cursor_x + 1;
+    v->modified = ec.modified;
+    snprintf(v->file_name, sizeof(v->file_name), "%s",
+             ec.file_name ? ec.file_name : "< New >");
+    memcpy(v->status_msg, ec.status_msg, sizeof(v->status_msg));
+
+    view.back = __atomic_exchange_n(&view.middle, view.back | VIEW_FRESH,
+                                    __ATOMIC_ACQ_REL) &
+                ~VIEW_FRESH;
+    mark_dirty();
+}
+
+/* Append the cells that changed in line y, with cursor jumps between runs */
+void screen_diff_line(editor_buf *eb, int y, int *attr)
+{
+    screen_cell *old = &screen.prev[y * screen.cols];
+    screen_cell *new = &screen.next[y * screen.cols];
+    int cols = screen.cols;
+    /* a run of blanks at the end of the line is cleared with one \x1b[K */
+    int blank = cols;
+    while ((blank > 0) && (new[blank - 1].c == ' ') &&
+           (new[blank - 1].attr == new[cols - 1].attr))
+        blank--;
+    /* the terminal lays out multibyte characters on its own, so lines with
+     * them are sent whole rather than in pieces
+     */
+    bool whole = false;
+    for (int x = 0; (x < cols) && !whole; x++)
+        whole = ((unsigned char) old[x].c >= 0x80) ||
+                ((unsigned char) new[x].c >= 0x80);
+    int x = 0;
+    while (x < cols) {
+        if (cell_equal(old[x], new[x])) {
+            x++;
+            continue;
+        }
+        int last = x;
+        for (int k = x + 1; (k < cols) && (k - last <= SCREEN_GAP); k++) {
+            if (!cell_equal(old[k], new[k]))
+                last = k;
+        }
+        if (whole) {
+            x = 0;
+            last = cols - 1;
+        }
+        buf_append_goto(eb, y, x);
+        int end = (last >= blank) ? blank : last + 1;
+        for (; x < end; x++) {
+            if (new[x].attr != *attr) {
+                *attr = new[x].attr;
+                buf_append(eb, theme.sgr[*attr].seq, theme.sgr[*attr].len);
+            }
+            buf_putc(eb, new[x].c);
+        }
+        if (last >= blank) {
+            if (new[blank].attr != *attr) {
+                *attr = new[blank].attr;
+                buf_append(eb, theme.sgr[*attr].seq, theme.sgr[*attr].len);
+            }
+            buf_append_str(eb, "\x1b[K");
+            break;
+        }
+    }
+}
+
+/* Scroll the text area up by n lines, or down if n is negative, both on the
+ * terminal and in prev: only the lines scrolled into view are left to send.
+ * The lines come and go with delete/insert line inside a scroll region, so
+ * the status and message bars stay put.
+ */
+void screen_scroll(editor_buf *eb, int n, int *attr)
+{
+    int text_rows = screen.rows - 2, cols = screen.cols;
+    /* blank lines take the current background */
+    if (*attr != NORMAL) {
+        *attr = NORMAL;
+        buf_append(eb, theme.sgr[NORMAL].seq, theme.sgr[NORMAL].len);
+    }
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (ec.cursor_y - ec.row_offset) + 1,
-             (ec.render_x - ec.col_offset) + 1);
-    buf_append(&eb, buf, strlen(buf));
-    buf_append(&eb, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, eb.buf, eb.len);
-    buf_free(&eb);
+    /* setting the region moves the cursor to its top */
+    buf_append(eb, buf, snprintf(buf, sizeof(buf), "\x1b[1;%dr", text_rows));
+    buf_append(eb, buf, snprintf(buf, sizeof(buf), "\x1b[%d%c", abs(n),
+                                 (n > 0) ? 'M' : 'L'));
+    buf_append_str(eb, "\x1b[r");
+
+    int kept = text_rows - abs(n);
+    screen_cell *text = screen.prev;
+    if (n > 0) {
+        memmove(text, &text[n * cols], kept * cols * sizeof(screen_cell));
+        text += kept * cols;
+    } else
+        memmove(&text[-n * cols], text, kept * cols * sizeof(screen_cell));
+    for (int i = 0; i < abs(n) * cols; i++)
+        text[i] = (screen_cell){' ', NORMAL};
 }
 
-void handle_sigwinch()
+void refresh_screen()
 {
-    update_window_size();
-    if (ec.cursor_y > ec.screen_rows)
-        ec.cursor_y = ec.screen_rows - 1;
-    if (ec.cursor_x > ec.screen_cols)
-        ec.cursor_x = ec.screen_cols - 1;
-    refresh_screen();
+    /* take the latest view, if there is one the renderer has not seen */
+    if (__atomic_load_n(&view.middle, __ATOMIC_ACQUIRE) & VIEW_FRESH)
+        view.front = __atomic_exchange_n(&view.middle, view.front,
+                                         __ATOMIC_ACQ_REL) &
+                     ~VIEW_FRESH;
+    editor_view *v = &view.views[view.front];
+    if (!v->text)
+        return;
+    int row_offset = v->row_offset, col_offset = v->col_offset;
+    screen_resize(v->rows + 2, v->cols);
+    memcpy(screen.next, v->text, v->rows * v->cols * sizeof(screen_cell));
+    draw_statusbar(&screen.next[(screen.rows - 2) * screen.cols], v);
+    draw_messagebar(&screen.next[(screen.rows - 1) * screen.cols], v);
+
+    static editor_buf eb = {NULL, 0, 0};
+    eb.len = 0;
+    /* the terminal shows the frame all at once, without tearing */
+    if (ec.term & TERM_SYNC)
+        buf_append_str(&eb, "\x1b[?2026h");
+    buf_append_str(&eb, "\x1b[?25l");
+    int header_len = eb.len;
+    int attr = -1;
+    if (__atomic_exchange_n(&screen.stale, 0, __ATOMIC_RELAXED)) {
+        /* start over from a blank screen */
+        buf_append(&eb, theme.sgr[NORMAL].seq, theme.sgr[NORMAL].len);
+        buf_append_str(&eb, "\x1b[2J");
+        attr = NORMAL;
+        for (int i = 0; i < screen.rows * screen.cols; i++)
+            screen.prev[i] = (screen_cell){' ', NORMAL};
+    } else if ((ec.term & TERM_SCROLL) && (row_offset != screen.row_offset) &&
+               (abs(row_offset - screen.row_offset) < screen.rows - 2) &&
+               (col_offset == screen.col_offset))
+        screen_scroll(&eb, row_offset - screen.row_offset, &attr);
+    screen.row_offset = row_offset;
+    screen.col_offset = col_offset;
+    for (int y = 0; y < screen.rows; y++)
+        screen_diff_line(&eb, y, &attr);
+    /* leave the attributes as they were before the frame */
+    if ((attr != -1) && (attr != NORMAL))
+        buf_append_str(&eb, "\x1b[m");
+    int cursor_y = v->cursor_y, cursor_x = v->cursor_x;
+    bool changed = (eb.len != header_len) || (cursor_y != screen.cursor_y) ||
+                   (cursor_x != screen.cursor_x);
+    screen.cursor_y = cursor_y;
+    screen.cursor_x = cursor_x;
+    buf_append_goto(&eb, cursor_y, cursor_x);
+    buf_append_str(&eb, "\x1b[?25h");
+    if (ec.term & TERM_SYNC)
+        buf_append_str(&eb, "\x1b[?2026l");
+    /* what the terminal shows is unknown after a failed write */
+    if (changed && (write_all(STDOUT_FILENO, eb.buf, eb.len) == -1))
+        screen.stale = 1;
+    screen_cell *prev = screen.prev;
+    screen.prev = screen.next;
+    screen.next = prev;
 }
 
-void handle_sigcont()
+void handle_signal()
 {
-    disable_raw_mode();
-    open_buffer();
-    enable_raw_mode();
-    refresh_screen();
+    struct signalfd_siginfo info;
+    while (read(ec.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGWINCH:
+            update_window_size();
+            publish_view();
+            break;
+        case SIGCONT:
+            /* the terminal may have been used by others while stopped */
+            disable_raw_mode();
+            open_buffer();
+            enable_raw_mode();
+            __atomic_store_n(&screen.stale, 1, __ATOMIC_RELAXED);
+            mark_dirty();
+            break;
+        case SIGTERM:
+            save_wait();
+            clear_screen();
+            close_buffer();
+            exit(0);
+        }
+    }
+}
+
+/* Block until there is input, handling the other events as they come.
+ * Nothing here wakes up unless something happened; meanwhile the rows are
+ * left to the lexer worker.
+ */
+void wait_input()
+{
+    struct pollfd fds[] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {ec.signal_fd, POLLIN, 0},
+        {ec.message_timer, POLLIN, 0},
+        {ec.wake_fd, POLLIN, 0},
+    };
+    while (1) {
+        lexer_release();
+        int ready = poll(fds, sizeof(fds) / sizeof(fds[0]), -1);
+        lexer_acquire();
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            panic("Error waiting for input");
+        }
+        if (fds[1].revents)
+            handle_signal();
+        uint64_t count;
+        if (fds[2].revents &&
+            (read(ec.message_timer, &count, sizeof(count)) > 0)) {
+            ec.status_msg[0] = '\0';
+            publish_view();
+        }
+        if (fds[3].revents &&
+            (read(ec.wake_fd, &count, sizeof(count)) > 0)) {
+            save_poll();
+            map_poll();
+        }
+        if (fds[0].revents)
+            return;
+    }
 }
 
 char *prompt(char *msg, void (*callback)(char *, int))
@@ -919,8 +3469,7 @@ char *prompt(char *msg, void (*callback)(char *, int))
     buf[0] = '\0';
     while (1) {
         set_status_message(msg, buf);
-        refresh_screen();
-        int c = read_key();
+        int c = read_key() & ~KEY_MODS;
         if ((c == DEL_KEY) || (c == CTRL_('h')) || (c == BACKSPACE)) {
             if (buf_len != 0)
                 buf[--buf_len] = '\0';
@@ -952,15 +3501,14 @@ char *prompt(char *msg, void (*callback)(char *, int))
 
 void move_cursor(int key)
 {
-    editor_row *row =
-        (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
+    editor_row *row = row_at(ec.cursor_y);
     switch (key) {
     case ARROW_LEFT:
         if (ec.cursor_x != 0)
             ec.cursor_x--;
         else if (ec.cursor_y > 0) {
             ec.cursor_y--;
-            ec.cursor_x = ec.row[ec.cursor_y].size;
+            ec.cursor_x = row_at(ec.cursor_y)->size;
         }
         break;
     case ARROW_RIGHT:
@@ -980,7 +3528,7 @@ void move_cursor(int key)
             ec.cursor_y++;
         break;
     }
-    row = (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
+    row = row_at(ec.cursor_y);
     int row_len = row ? row->size : 0;
     if (ec.cursor_x > row_len)
         ec.cursor_x = row_len;
@@ -990,6 +3538,11 @@ void process_key()
 {
     static int indent_level = 0;
     int c = read_key();
+    /* Beyond going to either end of the file with Ctrl-Home and Ctrl-End,
+     * modifiers make no difference to a key
+     */
+    if ((c != (KEY_CTRL | HOME_KEY)) && (c != (KEY_CTRL | END_KEY)))
+        c &= ~KEY_MODS;
     switch (c) {
     case '\r':
         newline();
@@ -997,6 +3550,7 @@ void process_key()
             insert_char('\t');
         break;
     case CTRL_('q'):
+        save_wait();
         if (ec.modified &&
             !prompt("File has been modified. Type 'yes' and enter "
                     "to force quit (ESC to cancel)",
@@ -1020,6 +3574,12 @@ void process_key()
     case CTRL_('v'):
         paste();
         break;
+    case PASTE_START: {
+        size_t len;
+        char *text = read_paste(&len);
+        insert_text(text, len);
+        free(text);
+    } break;
     case ARROW_UP:
     case ARROW_DOWN:
     case ARROW_LEFT:
@@ -1039,13 +3599,24 @@ void process_key()
     case HOME_KEY:
         ec.cursor_x = 0;
         break;
+    case KEY_CTRL | HOME_KEY:
+        ec.cursor_y = 0;
+        ec.cursor_x = 0;
+        break;
+    case KEY_CTRL | END_KEY:
+        ec.cursor_y = ec.num_rows;
+        ec.cursor_x = 0;
+        break;
     case END_KEY:
         if (ec.cursor_y < ec.num_rows)
-            ec.cursor_x = ec.row[ec.cursor_y].size;
+            ec.cursor_x = row_at(ec.cursor_y)->size;
         break;
     case CTRL_('f'):
         search();
         break;
+    case CTRL_('g'):
+        show_memory_usage();
+        break;
     case BACKSPACE:
     case CTRL_('h'):
     case DEL_KEY:
@@ -1054,6 +3625,8 @@ void process_key()
         delete_char();
         break;
     case CTRL_('l'):
+        __atomic_store_n(&screen.stale, 1, __ATOMIC_RELAXED);
+        break;
     case '\x1b':
         break;
     case '{':
@@ -1065,8 +3638,8 @@ void process_key()
             goto none;
         if ((ec.cursor_x == 0) && (ec.cursor_y == 0))
             goto none;
-        editor_row *row = &ec.row[ec.cursor_y];
-        if ((ec.cursor_x > 0) && (row->chars[ec.cursor_x - 1] == '\t'))
+        editor_row *row = row_at(ec.cursor_y);
+        if ((ec.cursor_x > 0) && (row_char(row, ec.cursor_x - 1) == '\t'))
             delete_char();
     none:
         insert_char(c);
@@ -1077,37 +3650,155 @@ void process_key()
     }
 }
 
+/* Frames are held back while the terminal has not yet taken this much of
+ * our output from the tty: over a slow link it would only pile up.
+ */
+#define OUTQ_LIMIT 4096
+#define OUTQ_LIMIT_LOW 512
+#define OUTQ_BACKOFF 10 /* ms between looks at the output queue */
+
+int output_backlog()
+{
+    int queued;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) == -1)
+        return 0;
+    return queued;
+}
+
+long ms_since(struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 +
+           (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* A timer at the turn of each second, for the clock in the status bar */
+int clock_timer()
+{
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = {{1, 0}, {time(NULL) + 1, 0}};
+    if ((fd != -1) &&
+        (timerfd_settime(fd, TFD_TIMER_ABSTIME, &tick, NULL) == -1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 void *refresh_thread(void *dummy)
 {
+    /* poll() skips the clock in low-bandwidth mode, where its fd is -1 */
+    struct pollfd fds[] = {
+        {frame_pipe[0], POLLIN, 0},
+        {ec.low_bandwidth ? -1 : clock_timer(), POLLIN, 0},
+    };
+    struct timespec last_frame = {0, 0};
+    int backlog_limit = ec.low_bandwidth ? OUTQ_LIMIT_LOW : OUTQ_LIMIT;
     while (1) {
+        uint64_t ticks;
+        if ((poll(fds, 2, -1) > 0) && fds[1].revents)
+            read(fds[1].fd, &ticks, sizeof(ticks));
+        /* Wait out the frame interval and any output backlog.  Whatever is
+         * marked dirty meanwhile is folded into this frame, which is drawn
+         * from the newest state.
+         */
+        long wait;
+        while (((wait = 1000 / ec.frame_rate - ms_since(&last_frame)) > 0) ||
+               (output_backlog() > backlog_limit))
+            poll(NULL, 0, (wait > 0) ? wait : OUTQ_BACKOFF);
+        char buf[256];
+        while (read(frame_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &last_frame);
         refresh_screen();
-        usleep(1000);
     }
     return NULL;
 }
 
 void init_editor()
 {
+    if (pipe2(frame_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        panic("Failed to create the frame pipe");
     update_window_size();
-    signal(SIGWINCH, handle_sigwinch);
-    signal(SIGCONT, handle_sigcont);
+    /* Signals are taken as events in the editing thread's loop.  They stay
+     * blocked in every thread, which all inherit this mask.
+     */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGCONT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    ec.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    ec.message_timer =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ec.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((ec.signal_fd == -1) || (ec.message_timer == -1) ||
+        (ec.wake_fd == -1))
+        panic("Failed to set up the event loop");
+    struct sigaction sa = {.sa_sigaction = map_fault, .sa_flags = SA_SIGINFO};
+    sigaction(SIGBUS, &sa, NULL);
 }
 
 int main(int argc, char *argv[])
 {
+    int opt;
+    while ((opt = getopt(argc, argv, "e:lr:s:t:y:")) != -1) {
+        if ((opt == 's') && !strcmp(optarg, "none"))
+            ec.save_sync = SYNC_NONE;
+        else if ((opt == 's') && !strcmp(optarg, "file"))
+            ec.save_sync = SYNC_FILE;
+        else if ((opt == 's') && !strcmp(optarg, "full"))
+            ec.save_sync = SYNC_FULL;
+        else if (opt == 't') {
+            if (theme_load(optarg) == -1)
+                return 1;
+        } else if (opt == 'y') {
+            if (syntax_load(optarg) == -1)
+                return 1;
+        } else if (opt == 'l')
+            ec.low_bandwidth = true;
+        else if ((opt == 'r') && (atoi(optarg) > 0) && (atoi(optarg) <= 1000))
+            ec.frame_rate = atoi(optarg);
+        else if ((opt == 'e') && (atoi(optarg) >= 0))
+            ec.esc_timeout = atoi(optarg);
+        else {
+            fprintf(stderr,
+                    "Usage: %s [-e ms] [-l] [-r fps] [-s none|file|full] "
+                    "[-t theme] [-y syntax] [filename]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (!ec.frame_rate)
+        ec.frame_rate = ec.low_bandwidth ? 10 : 60;
+    FILE *fp = fmemopen((void *) builtin_syntax, strlen(builtin_syntax), "r");
+    if (!fp || (syntax_parse(fp, "built-in syntax") == -1))
+        return 1;
+    fclose(fp);
     init_editor();
-    if (argc >= 2)
-        open_file(argv[1]);
+    if (optind < argc)
+        open_file(argv[optind]);
     enable_raw_mode();
+    probe_terminal();
+    theme_build();
     set_status_message(
         "Mazu Editor | ^Q Exit | ^S Save | ^F Search | "
         "^C Copy | ^X Cut | ^V Paste");
-    if (pthread_create(&(pthread_t){0}, NULL, &refresh_thread, NULL)) {
+    pthread_mutex_lock(&lexer.lock); /* given up only to wait for input */
+    if (pthread_create(&(pthread_t){0}, NULL, &refresh_thread, NULL) ||
+        pthread_create(&(pthread_t){0}, NULL, &lexer_thread, NULL)) {
         perror("pthread_create");
         return 1;
     }
-    while (1)
-        process_key();
+    while (1) {
+        do
+            process_key();
+        while (input_pending());
+        slab_compact();
+        publish_view();
+    }
     /* not reachable */
     return 0;
 }
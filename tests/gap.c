@@ -0,0 +1,55 @@
+/* Typing in the middle of a long line must leave its gap where the cursor
+ * is, through the edit and the frame drawn after it: closing the gap costs
+ * two moves of the tail of the line on every key.
+ */
+#define main me_main
+#include "../me.c"
+#undef main
+
+#define LINE_LEN (1 << 20)
+
+/* What a frame does to the row on screen */
+static void frame(editor_row *row)
+{
+    highlight_view(0, 0);
+    materialize_row(row, 0);
+}
+
+static int type_at(const char *name, int at)
+{
+    free(ec.file_name);
+    ec.file_name = strdup(name);
+    select_highlight();
+    char *line = malloc(LINE_LEN);
+    for (int i = 0; i < LINE_LEN; i++)
+        line[i] = "int x = 1; /* y */ \"z\"\t"[i % 24];
+    close_file();
+    insert_row(0, line, LINE_LEN);
+    free(line);
+    editor_row *row = row_at(0);
+    frame(row);
+    for (int i = 0; i < 3; i++) {
+        row_insert_char(row, at + i, 'a');
+        frame(row);
+        if (row->gap != at + i + 1) {
+            fprintf(stderr, "%s: gap at %d after typing at %d\n", name,
+                    row->gap, at + i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    FILE *fp = fmemopen((void *) builtin_syntax, strlen(builtin_syntax), "r");
+    if (!fp || (syntax_parse(fp, "built-in syntax") == -1))
+        return 1;
+    fclose(fp);
+    int failed = 0;
+    failed |= type_at("a.c", 1000);
+    failed |= type_at("a.json", 1000);
+    failed |= type_at("a.txt", 1000);
+    printf("%s\n", failed ? "FAIL" : "ok");
+    return failed ? 1 : 0;
+}